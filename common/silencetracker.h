@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef SILENCETRACKER_H
+#define SILENCETRACKER_H
+
+#include <cmath>
+#include <cstring>
+
+#include "pluginterfaces/vst/ivstaudioprocessor.h"
+
+// Output below this level is silence
+#define SILENCE_THRESHOLD 1e-6
+
+// Tracks silence flags of the input bus and
+// the level of the output, so process() can skip
+// the DSP once its state has decayed.
+//
+// 'decay' is the time the DSP needs to settle below
+// SILENCE_THRESHOLD after its input stops, given by
+// its slowest filter or envelope release.
+//
+// The DSP state is left as it is while sleeping.
+// It has already decayed below the threshold, and
+// Faust's instanceClear() would also reset parameter
+// smoothers and biased state, so the first block
+// after the input comes back would jump.
+class SilenceTracker
+{
+public:
+  void setup(double sampleRate, double decay)
+  {
+    hold = (Steinberg::int64)(sampleRate * decay) + 1;
+    silentSamples = 0;
+  }
+
+  void reset()
+  {
+    silentSamples = 0;
+  }
+
+  // Before the DSP: true when the input is silent
+  // and the state has decayed. The output is then
+  // zeroed and flagged, the DSP need not run.
+  bool sleeping(Steinberg::Vst::ProcessData &data, Steinberg::int32 numChannels)
+  {
+    if (!inputSilent(data, numChannels) || (silentSamples < hold))
+    {
+      return false;
+    }
+
+    clear(data, numChannels);
+    return true;
+  }
+
+  // After the DSP: counts silent output while the
+  // input is silent. Once the state has decayed the
+  // output is zeroed and flagged.
+  void update(Steinberg::Vst::ProcessData &data, Steinberg::int32 numChannels)
+  {
+    if (!inputSilent(data, numChannels))
+    {
+      silentSamples = 0;
+      return;
+    }
+
+    for (Steinberg::int32 c = 0; c < numChannels; c++)
+    {
+      float *out = data.outputs[0].channelBuffers32[c];
+      for (Steinberg::int32 i = 0; i < data.numSamples; i++)
+      {
+        if (fabs(out[i]) >= SILENCE_THRESHOLD)
+        {
+          silentSamples = 0;
+          return;
+        }
+      }
+    }
+
+    silentSamples += data.numSamples;
+    if (silentSamples < hold)
+    {
+      return;
+    }
+
+    // Remaining output is below SILENCE_THRESHOLD,
+    // zero it so the flag tells the truth
+    clear(data, numChannels);
+  }
+
+  static bool inputSilent(Steinberg::Vst::ProcessData &data, Steinberg::int32 numChannels)
+  {
+    Steinberg::uint64 channelMask = ((Steinberg::uint64)1 << numChannels) - 1;
+    return (data.inputs[0].silenceFlags & channelMask) == channelMask;
+  }
+
+  // Zeroes the output bus and flags it silent
+  static void clear(Steinberg::Vst::ProcessData &data, Steinberg::int32 numChannels)
+  {
+    for (Steinberg::int32 c = 0; c < numChannels; c++)
+    {
+      memset(data.outputs[0].channelBuffers32[c], 0, data.numSamples * sizeof(float));
+    }
+    data.outputs[0].silenceFlags = ((Steinberg::uint64)1 << numChannels) - 1;
+  }
+
+private:
+  // Samples of silent output since
+  // the input went silent
+  Steinberg::int64 silentSamples = 0;
+  Steinberg::int64 hold = 1;
+};
+
+#endif
@@ -50,8 +50,14 @@
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
 #include "faust-support.h"
+#include "../../common/silencetracker.h"
 #include "kpp_bluedream_dsp.h"
 
+// Time the DSP state needs to decay below
+// SILENCE_THRESHOLD, set by the DC blockers
+// (about 65 ms at 44100 Hz)
+#define SILENCE_DECAY 0.1
+
 namespace Steinberg {
 namespace Vst {
   //-----------------------------------------------------------------------------
@@ -89,6 +95,8 @@ namespace Vst {
     ParamValue mVolume = 0;
     ParamValue mVoice = 0;
     bool mBypass = false;
+
+    SilenceTracker silence;
   };
 
   //------------------------------------------------------------------------
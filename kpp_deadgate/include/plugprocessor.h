@@ -50,8 +50,14 @@
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
 #include "faust-support.h"
+#include "../../common/silencetracker.h"
 #include "kpp_deadgate_dsp.h"
 
+// Time the DSP state needs to decay below
+// SILENCE_THRESHOLD, set by the 10 Hz input
+// highpass and the gate hold and release
+#define SILENCE_DECAY 0.3
+
 namespace Steinberg {
 namespace Vst {
   //-----------------------------------------------------------------------------
@@ -85,6 +91,8 @@ namespace Vst {
     ParamValue mDeadzone = 0;
     ParamValue mNoisegate = 0;
     bool mBypass = false;
+
+    SilenceTracker silence;
   };
 
   //------------------------------------------------------------------------
@@ -50,8 +50,14 @@
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
 #include "faust-support.h"
+#include "../../common/silencetracker.h"
 #include "kpp_distruction_dsp.h"
 
+// Time the DSP state needs to decay below
+// SILENCE_THRESHOLD, set by the 30 Hz
+// highpass of the post filter
+#define SILENCE_DECAY 0.1
+
 namespace Steinberg {
 namespace Vst {
   //-----------------------------------------------------------------------------
@@ -89,6 +95,8 @@ namespace Vst {
     ParamValue mVolume = 0;
     ParamValue mVoice = 0;
     bool mBypass = false;
+
+    SilenceTracker silence;
   };
 
   //------------------------------------------------------------------------
@@ -50,8 +50,14 @@
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
 #include "faust-support.h"
+#include "../../common/silencetracker.h"
 #include "kpp_fuzz_dsp.h"
 
+// Time the DSP state needs to decay below
+// SILENCE_THRESHOLD, set by the bias of the
+// fuzz stage recovering with a 10 ms constant
+#define SILENCE_DECAY 0.2
+
 namespace Steinberg {
   namespace Vst {
 
@@ -87,6 +93,8 @@ namespace Steinberg {
       Vst::ParamValue mTone = 0;
       Vst::ParamValue mVolume = 0;
       bool mBypass = false;
+
+      SilenceTracker silence;
     };
 
     //------------------------------------------------------------------------
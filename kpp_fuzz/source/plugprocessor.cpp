@@ -95,6 +95,7 @@ namespace Vst {
   {
     sampleRate = setup.sampleRate;
     dsp->init(sampleRate);
+    silence.setup(sampleRate, SILENCE_DECAY);
     dsp->buildUserInterface(ui);
     return AudioEffect::setupProcessing (setup);
   }
@@ -185,9 +186,18 @@ namespace Vst {
         outputs[1] = data.outputs[0].channelBuffers32[0];
       }
 
+      data.outputs[0].silenceFlags = 0;
+
       if (!mBypass)
       {
+        if (silence.sleeping(data, numChannels))
+        {
+          return kResultOk;
+        }
+
         dsp->compute(data.numSamples, inputs, outputs);
+
+        silence.update(data, numChannels);
       }
       else
       {
@@ -196,6 +206,12 @@ namespace Vst {
           outputs[0][i] = inputs[0][i];
           outputs[1][i] = inputs[1][i];
         }
+
+        uint64 channelMask = ((uint64)1 << numChannels) - 1;
+        data.outputs[0].silenceFlags = data.inputs[0].silenceFlags & channelMask;
+
+        // DSP did not see this input
+        silence.reset();
       }
     }
     return kResultOk;
@@ -50,8 +50,14 @@
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
 #include "faust-support.h"
+#include "../../common/silencetracker.h"
 #include "kpp_octaver_dsp.h"
 
+// Time the DSP state needs to decay below
+// SILENCE_THRESHOLD, set by the DC blockers
+// and the 40 Hz highpass of the first octave
+#define SILENCE_DECAY 0.2
+
 namespace Steinberg {
 namespace Vst {
 
@@ -88,6 +94,8 @@ namespace Vst {
     ParamValue mDry = 0;
     ParamValue mCutoff = 0;
     bool mBypass = false;
+
+    SilenceTracker silence;
   };
 
   //------------------------------------------------------------------------
@@ -50,8 +50,14 @@
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
 #include "faust-support.h"
+#include "../../common/silencetracker.h"
 #include "kpp_single2humbucker_dsp.h"
 
+// Time the DSP state needs to decay below
+// SILENCE_THRESHOLD, set by the 20 Hz
+// highpass in front of the delay
+#define SILENCE_DECAY 0.15
+
 namespace Steinberg {
 namespace Vst {
   //-----------------------------------------------------------------------------
@@ -85,6 +91,8 @@ namespace Vst {
     ParamValue mHumbuckerize = 0;
     ParamValue mBasscut = 0;
     bool mBypass = false;
+
+    SilenceTracker silence;
   };
 
   //------------------------------------------------------------------------
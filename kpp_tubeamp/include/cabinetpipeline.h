@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef CABINETPIPELINE_H
+#define CABINETPIPELINE_H
+
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "profileloader.h"
+
+// Cabinet stage of one chain call
+struct stCabinetJob
+{
+  stProfile *profile = nullptr;
+  // Outgoing profile during a crossfade
+  stProfile *fading = nullptr;
+
+  float cabinet = 1.0;
+  bool wet = false;
+  bool fadingWet = false;
+
+  // Crossfade position at the first sample
+  // and length of the whole crossfade
+  int32_t fadeStart = 0;
+  int32_t fadeLength = 0;
+  int32_t count = 0;
+
+  // Per sample step of the cabinet
+  // ramp after a flush
+  float rampStep = 1.0;
+
+  // Time spent on the outgoing profile,
+  // filled in by the worker
+  int64_t fade_time_ns = 0;
+};
+
+// Runs the cabinet stage of the chain on its own
+// thread, one chain call behind the audio thread.
+//
+// Audio thread fills amp() and job, then post().
+// The next call waits for the job with wait(),
+// moves its output into the delay ring with push()
+// and takes the delayed output with pull().
+class CabinetPipeline
+{
+public:
+  CabinetPipeline() {}
+  ~CabinetPipeline();
+
+  // Message thread: allocates buffers for chain calls
+  // of up to 'bufsize' samples, output comes 'latency'
+  // samples late, and starts the worker calling 'work'
+  void start(int bufsize, int latency, std::function<void()> work);
+  void stop();
+
+  bool running() const { return thread.joinable(); }
+  int latency() const { return delay; }
+
+  // Audio thread
+  void post();
+  void wait();
+
+  // Input buffer of the next job
+  float* amp() { return ampbuf[side].data(); }
+  // Input buffer of the posted job
+  const float* jobAmp() const { return ampbuf[side ^ 1].data(); }
+
+  // Moves output of a finished job into the ring
+  void push();
+  // Writes 'count' samples straight into the ring
+  void push(const float *left, const float *right, int count);
+  // Reads the next 'count' delayed samples
+  void pull(float *left, float *right, int count);
+
+  stCabinetJob job;
+
+  // Output of the job and the worker's own crossfade gains
+  std::vector<float> out_l;
+  std::vector<float> out_r;
+  std::vector<float> fade_in;
+  std::vector<float> fade_out;
+
+private:
+  void run();
+
+  std::thread thread;
+  std::function<void()> work;
+  ZCsema trig;
+  ZCsema done;
+  bool quit = false;
+  bool busy = false;
+  bool finished = false;
+
+  std::vector<float> ampbuf[2];
+  int side = 0;
+
+  std::vector<float> ring_l;
+  std::vector<float> ring_r;
+  uint32_t mask = 0;
+  int delay = 0;
+  int64_t writePos = 0;
+  int64_t readPos = 0;
+};
+
+#endif
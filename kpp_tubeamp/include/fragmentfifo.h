@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef FRAGMENTFIFO_H
+#define FRAGMENTFIFO_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#define FIFO_MAX_CHANNELS 2
+
+// Feeds host blocks of any size to a processing
+// function which only takes whole fragments.
+//
+// With zero latency blocks are passed through
+// directly, this works only while every block is
+// a multiple of the fragment. Otherwise samples
+// are collected into fragments and come out
+// one fragment later, or with padding the short
+// rest is filled up with zeros.
+class FragmentFifo
+{
+public:
+  // 'chunk' is the largest count passed to the
+  // processing function, a multiple of 'maxFragment'.
+  // 'latency' is 0 or 'fragment'.
+  void setup(int fragment, int maxFragment, int channels, int chunk, int latency)
+  {
+    numChannels = std::min(channels, FIFO_MAX_CHANNELS);
+    chunkSize = chunk;
+    fragmentLimit = maxFragment;
+    delay = latency;
+
+    for (int c = 0; c < numChannels; c++)
+    {
+      inbuf[c].assign(maxFragment, 0.0);
+      outbuf[c].assign(maxFragment, 0.0);
+    }
+    fill = 0;
+
+    fragmentSize = 0;
+    setFragment(fragment);
+  }
+
+  // Audio thread: switches to another fragment size.
+  // Returns false and keeps the current one above
+  // 'maxFragment', the buffers would overflow.
+  // With latency samples collected so far are dropped.
+  bool setFragment(int fragment)
+  {
+    if ((fragment <= 0) || (fragment > fragmentLimit))
+    {
+      return false;
+    }
+
+    if (fragment == fragmentSize)
+    {
+      return true;
+    }
+
+    fragmentSize = fragment;
+    maxChunk = std::max(chunkSize - chunkSize % fragment, fragment);
+
+    if (delay > 0)
+    {
+      delay = fragment;
+      reset();
+    }
+    return true;
+  }
+
+  int fragment() const { return fragmentSize; }
+  int maxFragment() const { return fragmentLimit; }
+
+  // Offline rendering: a block of unaligned size,
+  // usually the last one, is padded with zeros to
+  // whole fragments instead of giving up zero
+  // latency in the middle of the render. The
+  // padding is convolved as if it were input.
+  void setPadding(bool enable) { padding = enable; }
+
+  // Drops collected samples
+  void reset()
+  {
+    for (int c = 0; c < numChannels; c++)
+    {
+      std::fill(inbuf[c].begin(), inbuf[c].end(), 0.0);
+      std::fill(outbuf[c].begin(), outbuf[c].end(), 0.0);
+    }
+    fill = 0;
+  }
+
+  // Changes in process() and setFragment(),
+  // the caller reports it to the host
+  int latency() const { return delay; }
+
+  // True if zero latency had to be given up
+  // because of a block of unaligned size,
+  // kept over setup() calls. Set on the audio
+  // thread, read on the message thread.
+  bool latencyGrown() const { return grown.load(std::memory_order_relaxed); }
+
+  // Calls chain(float **in, float **out, int count),
+  // 'in' and 'out' may be the same buffers
+  template <typename F>
+  void process(float **in, float **out, int count, F chain)
+  {
+    if (delay == 0)
+    {
+      if ((count % fragmentSize == 0) || padding)
+      {
+        int whole = count - count % fragmentSize;
+        for (int pos = 0; pos < whole; pos += maxChunk)
+        {
+          float *chunkIn[FIFO_MAX_CHANNELS];
+          float *chunkOut[FIFO_MAX_CHANNELS];
+          for (int c = 0; c < numChannels; c++)
+          {
+            chunkIn[c] = in[c] + pos;
+            chunkOut[c] = out[c] + pos;
+          }
+          chain(chunkIn, chunkOut, std::min(maxChunk, whole - pos));
+        }
+
+        int rest = count - whole;
+        if (rest > 0)
+        {
+          float *padIn[FIFO_MAX_CHANNELS];
+          float *padOut[FIFO_MAX_CHANNELS];
+          for (int c = 0; c < numChannels; c++)
+          {
+            padIn[c] = inbuf[c].data();
+            padOut[c] = outbuf[c].data();
+            memcpy(padIn[c], in[c] + whole, rest * sizeof(float));
+            std::fill(inbuf[c].begin() + rest, inbuf[c].begin() + fragmentSize, 0.0);
+          }
+          chain(padIn, padOut, fragmentSize);
+          for (int c = 0; c < numChannels; c++)
+          {
+            memcpy(out[c] + whole, padOut[c], rest * sizeof(float));
+          }
+        }
+        return;
+      }
+
+      // Output of this block would need samples
+      // not received yet, from here on run one
+      // fragment late. Earlier blocks went out
+      // directly, nothing is pending: output starts
+      // with one fragment of zeros while the first
+      // fragment is collected.
+      delay = fragmentSize;
+      grown.store(true, std::memory_order_relaxed);
+      fill = 0;
+      for (int c = 0; c < numChannels; c++)
+      {
+        std::fill(outbuf[c].begin(), outbuf[c].begin() + fragmentSize, 0.0);
+      }
+    }
+
+    float *fifoIn[FIFO_MAX_CHANNELS];
+    float *fifoOut[FIFO_MAX_CHANNELS];
+    for (int c = 0; c < numChannels; c++)
+    {
+      fifoIn[c] = inbuf[c].data();
+      fifoOut[c] = outbuf[c].data();
+    }
+
+    int pos = 0;
+    while (pos < count)
+    {
+      int take = std::min(count - pos, fragmentSize - fill);
+
+      for (int c = 0; c < numChannels; c++)
+      {
+        memcpy(fifoIn[c] + fill, in[c] + pos, take * sizeof(float));
+      }
+      for (int c = 0; c < numChannels; c++)
+      {
+        memcpy(out[c] + pos, fifoOut[c] + fill, take * sizeof(float));
+      }
+
+      fill += take;
+      pos += take;
+
+      if (fill == fragmentSize)
+      {
+        chain(fifoIn, fifoOut, fragmentSize);
+        fill = 0;
+      }
+    }
+  }
+
+private:
+  int fragmentSize = 0;
+  int numChannels = 0;
+  int chunkSize = 0;
+  int maxChunk = 0;
+  int fragmentLimit = 0;
+  int delay = 0;
+  std::atomic<bool> grown {false};
+  bool padding = false;
+
+  std::vector<float> inbuf[FIFO_MAX_CHANNELS];
+  std::vector<float> outbuf[FIFO_MAX_CHANNELS];
+  int fill = 0;
+};
+
+#endif
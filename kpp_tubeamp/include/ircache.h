@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef IRCACHE_H
+#define IRCACHE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+#include "kpp_tubeamp.h"
+#include "tapffile.h"
+
+#define HAVE_STRUCT_TIMESPEC
+#include "../thirdparty/zita-convolver/zita-convolver.h"
+
+// Default and supported head partition sizes
+// of the convolvers, powers of two
+#define fragm 64
+#define PARTITION_MIN 16
+#define PARTITION_MAX 1024
+
+// Partition range of uniform convolvers
+// used for offline processing
+#define PARTITION_OFFLINE_MIN 256
+#define PARTITION_OFFLINE_MAX 4096
+
+// Cabinet IR tail is dropped where its remaining
+// energy is this far below the whole IR energy,
+// the kept part ends with a short fade out
+#define IR_TRIM_THRESHOLD_DB -90.0
+#define IR_TRIM_FADE_TIME 0.005
+
+// Longest cabinet IR kept, in seconds
+#define IR_CABINET_MAX_TIME 0.5
+
+// Resampled IRs on disk are limited to this many
+// bytes, least recently used files are removed first
+#define IR_CACHE_MAX_SIZE (256ll * 1024 * 1024)
+
+// Default of stIrOptions::half_spectra
+#ifndef IR_HALF_SPECTRA
+#define IR_HALF_SPECTRA false
+#endif
+
+// Load-time IR processing, chosen per profile
+struct stIrOptions
+{
+  // Convert cabinet IR to minimum phase
+  bool min_phase = false;
+
+  // Head partition of both convolvers, smaller
+  // gives less latency, larger costs less CPU
+  uint32_t partition = fragm;
+
+  // All partitions of the head size, a single level
+  // convolved on the calling thread without workers
+  bool uniform = false;
+
+  // IR spectra stored in half precision, half
+  // the memory traffic of the multiply-accumulate.
+  // Needs F16C, float spectra are used without it.
+  bool half_spectra = IR_HALF_SPECTRA;
+
+  bool operator==(const stIrOptions &other) const
+  {
+    return (min_phase == other.min_phase) &&
+           (partition == other.partition) &&
+           (uniform == other.uniform) &&
+           (half_spectra == other.half_spectra);
+  }
+};
+
+// Immutable IR data of one profile
+// at one sample rate. Shared by all
+// plugin instances using that profile.
+struct stIrData
+{
+  st_profile_header header;
+
+  // Layout the convolvers are built for
+  float sample_rate = 48000.0;
+  uint32_t partition = fragm;
+  stIrOptions options;
+
+  // IR lengths after resampling
+  uint32_t preamp_size = 0;
+  uint32_t cabinet_size = 0;
+
+  // Cabinet convolver has one input, fed by the
+  // mono amp output, and one output if left and
+  // right IRs are identical, two otherwise
+  uint32_t cabinet_outputs = 2;
+
+  // Configured but never started convolvers,
+  // they only hold the IR partitions
+  Convproc preamp_convproc;
+  Convproc convproc;
+};
+
+// Process-wide cache of IR data, keyed by
+// profile file contents and sample rate.
+// Entries live as long as some instance uses them.
+class IrCache
+{
+public:
+  // Returns shared IR data for the mapped profile 'tapf',
+  // resamples it if no instance has it yet
+  static std::shared_ptr<const stIrData> get(const TapfFile &tapf, float sampleRate,
+                                             const stIrOptions &options);
+
+  // Configures per-instance convolvers with the layout
+  // of 'ir' and makes them use its IR partitions.
+  // Convolvers keep only their own input/output state.
+  static bool attach(const stIrData &ir, Convproc *preamp_convproc, Convproc *convproc);
+
+  // Error of half precision spectra against float spectra
+  // for the same IRs, in dB relative to the float output
+  struct stNullTest
+  {
+    double preamp_peak_db;
+    double preamp_rms_db;
+    double cabinet_peak_db;
+    double cabinet_rms_db;
+  };
+
+  // Runs white noise through both variants of the
+  // mapped profile 'tapf' and compares the outputs.
+  // Errors are -inf if half precision is unsupported.
+  static bool null_test(const TapfFile &tapf, float sampleRate,
+                        stIrOptions options, stNullTest &result);
+
+private:
+  // Content hash, sample rate, partition size,
+  // minimum phase, uniform partitions, half spectra
+  typedef std::tuple<uint64_t, int, int, bool, bool, bool> Key;
+
+  struct Entry
+  {
+    std::mutex mutex;
+    std::shared_ptr<stIrData> ir;
+  };
+
+  static std::mutex mutex;
+  static std::map<Key, std::weak_ptr<Entry>> entries;
+};
+
+#endif
@@ -107,17 +107,20 @@ process = preamp_amp with {
     - :
     fi.lowpass(1, 11000);
 
-    // Part of the chain before Voltage Sag in power amp
-    pre_sag = _,_ : + : fi.dcblocker : *(ba.db2linear(drive * 0.4) - 1) :
+    // Part of the chain before Voltage Sag in power amp.
+    // Mono input, doubled to keep the gain of the
+    // former sum of two identical channels
+    pre_sag = *(2.0) : fi.dcblocker : *(ba.db2linear(drive * 0.4) - 1) :
     *(preamp_level) : stage_preamp : fi.dcblocker :*(amp_level) :
     *(ba.db2linear(mastergain * 0.4) - 1) : stage_tonestack;
 
-    // All chain, pre-sag + power amp with Voltage Sag
+    // All chain, pre-sag + power amp with Voltage Sag,
+    // mono output, fanned out to stereo by the cabinet
     preamp_amp = pre_sag :
     (_,_ : (_<: (1.0/_),_),_ : _,* : _,stage_amp : *)
     ~ (_ <: _,_: * : fi.lowpass(1,sag_time) : *(sag_coeff) :
     max(1.0) : min(2.5)) : *(volume) :
-    *(output_level) : fi.dcblocker <: _,_;
+    *(output_level) : fi.dcblocker;
 };
 
 
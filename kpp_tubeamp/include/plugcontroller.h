@@ -88,6 +88,7 @@ namespace Vst {
     tresult PLUGIN_API setState(IBStream* state) SMTG_OVERRIDE;
     tresult PLUGIN_API getState(IBStream* state) SMTG_OVERRIDE;
     tresult PLUGIN_API setParamNormalized (ParamID tag, ParamValue value) SMTG_OVERRIDE;
+    tresult PLUGIN_API notify (IMessage* message) SMTG_OVERRIDE;
     tresult PLUGIN_API getParamStringByValue (ParamID tag, ParamValue valueNormalized,
                                               String128 string) SMTG_OVERRIDE;
                                               tresult PLUGIN_API getParamValueByString (ParamID tag, TChar* string,
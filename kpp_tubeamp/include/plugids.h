@@ -59,9 +59,24 @@ namespace Vst {
     kTrebleId = 104,
     kVolumeId = 105,
     kLevelId = 106,
-    kCabinetId = 107
+    kCabinetId = 107,
+    kMinPhaseId = 108,
+    kPartitionId = 109,
+    kPipelineId = 110,
+    kCrossfadeId = 111,
+    kCrossfadeLoadId = 112,
+    kLatencyId = 113,
+    kTailId = 114
   };
 
+  // Latency output parameter is the
+  // latency in samples divided by this
+  static const int32 kLatencyRange = 1 << 20;
+
+  // Same for the tail output parameter,
+  // long IRs at high sample rates fit
+  static const int32 kTailRange = 1 << 24;
+
 
   // HERE you have to define new unique class ids: for processor and for controller
   // you can use GUID creator tools like https://www.guidgenerator.com/
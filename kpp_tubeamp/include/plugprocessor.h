@@ -49,13 +49,37 @@
 
 #include "public.sdk/source/vst/vstaudioeffect.h"
 
+#include <atomic>
 #include <vector>
 
 #include "faust-support.h"
 #include "kpp_tubeamp_dsp.h"
-
-
-struct stProfile;
+#include "fragmentfifo.h"
+#include "cabinetpipeline.h"
+#include "profileloader.h"
+#include "../../common/silencetracker.h"
+
+// Processing stops after SILENCE_HOLD seconds of
+// silent output past both convolver tails
+#define SILENCE_HOLD 0.1
+
+// Cabinet output ramps in over this time after
+// its convolver was flushed, in seconds
+#define CABINET_RAMP_TIME 0.01
+
+// Samples passed through the stages between
+// the convolvers at once, a few kB of data
+#define CHAIN_TILE 64
+
+// Phases of a switch to a profile
+// with another partition size
+enum
+{
+  SWITCH_NONE,
+  SWITCH_OUT,
+  SWITCH_HOLD,
+  SWITCH_IN
+};
 
 namespace Steinberg {
 namespace Vst {
@@ -66,7 +90,9 @@ namespace Vst {
     PlugProcessor ();
 
     tresult PLUGIN_API initialize (FUnknown* context) SMTG_OVERRIDE;
+    tresult PLUGIN_API terminate () SMTG_OVERRIDE;
     tresult receiveText (const char* text) SMTG_OVERRIDE;
+    tresult PLUGIN_API notify (IMessage* message) SMTG_OVERRIDE;
     tresult PLUGIN_API setBusArrangements (Vst::SpeakerArrangement* inputs, int32 numIns,
                                            Vst::SpeakerArrangement* outputs,
                                            int32 numOuts) SMTG_OVERRIDE;
@@ -74,6 +100,8 @@ namespace Vst {
                                            tresult PLUGIN_API setupProcessing (Vst::ProcessSetup& setup) SMTG_OVERRIDE;
                                            tresult PLUGIN_API setActive (TBool state) SMTG_OVERRIDE;
                                            tresult PLUGIN_API process (Vst::ProcessData& data) SMTG_OVERRIDE;
+                                           uint32 PLUGIN_API getLatencySamples () SMTG_OVERRIDE;
+                                           uint32 PLUGIN_API getTailSamples () SMTG_OVERRIDE;
 
                                            //------------------------------------------------------------------------
                                            tresult PLUGIN_API setState (IBStream* state) SMTG_OVERRIDE;
@@ -83,14 +111,37 @@ namespace Vst {
 
   protected:
 
-    bool check_profile_file(const char *path);
-    stProfile* load_profile(const char *path);
-
     void setBufsize(int size);
 
+    uint32_t selectedPartition();
+    uint32 processingLatency();
+    uint32 fragmentLatency();
+    uint32 pipelineLatency();
+    void updateLatency();
+    void checkLatency(ProcessData &data);
+    void checkTail(ProcessData &data);
+
+    void processChain(float **in, float **out, int count);
+    void convolve(Convproc *convproc, int partition,
+                  const float *in, float *out, int count);
+    void cabinetState(stCabinetJob &job);
+    int64_t cabinetStep(const stCabinetJob &job, const float *amp,
+                        float *out_l, float *out_r, int count,
+                        const float *fade_in, const float *fade_out);
+    void cabinetJob();
+    void pipelineWait();
+    void fadeGains(float *fade_in, float *fade_out, int32 start, int32 length, int count);
+    void stop_cabinet(stProfile *cabinet);
+    bool cabinet_ready(stProfile *cabinet);
+    void crossfade(float *dst, const float *fading, int count, int offset);
+    void switchPartition();
+    void switchGain(ProcessData &data, int32 numChannels);
+
     TubeampDsp *dsp = nullptr;
 
-    float sampleRate;
+    float sampleRate = 48000.0;
+    // Host renders offline, not in real time
+    bool offline = false;
 
     ParamValue mDrive = 0;
     ParamValue mBass = 0;
@@ -101,17 +152,81 @@ namespace Vst {
     ParamValue mCabinet = 0;
     bool mBypass = false;
 
+    // Samples of silent amp output since
+    // the input went silent
+    int32 silentSamples = 0;
+    // Input silence flag of the block feeding the chain
+    bool chainInputSilent = false;
+
+    // Samples per tile of the stages between the
+    // convolvers, 0 runs each over the whole chain call.
+    // Output is the same either way.
+    int32 chainTile = CHAIN_TILE;
+
+    // Adapts host blocks to whole fragments
+    FragmentFifo fifo;
+
+    // Runs the cabinet stage one chain call
+    // behind, on its own thread
+    CabinetPipeline pipeline;
+    // Read by the audio thread for the latency
+    std::atomic<bool> pipelineSetting {false};
+
+    // Owned by the audio thread while active,
+    // replaced only through loader.acquire()
     stProfile *profile = nullptr;
+    ProfileLoader loader;
+
+    // Previous profile, runs alongside the new one
+    // until the crossfade is over, then retired
+    stProfile *outgoing = nullptr;
+    int32 crossfadeSamples = 0;
+    int32 fadeSample = 0;
+    // Crossfade setting in milliseconds,
+    // applied when the next crossfade starts
+    std::atomic<int32> crossfadeTime {PROFILE_CROSSFADE_TIME};
+    // Amp parameters during a crossfade, moved
+    // from the outgoing profile to the new one
+    st_profile_header fadeHeader;
+
+    // Profile with another partition size, it can not
+    // run alongside the current one. Output fades out,
+    // the profiles are switched while it is muted and
+    // it fades in again, see switchGain().
+    stProfile *pending = nullptr;
+    int switchState = SWITCH_NONE;
+    int32 switchSample = 0;
+    int32 switchLength = 0;
 
     std::string profilePath;
+    stIrOptions irOptions;
+    // Partition size chosen by the user,
+    // 0 picks it from the host block size
+    uint32_t partitionSetting = 0;
+
+    // Latency last reported to the host,
+    // set by the message and the audio thread
+    std::atomic<uint32> latencySamples {0};
+    // FIFO delay last seen by the audio thread
+    int fifoLatency = 0;
+    // Convolver tail of the running profile,
+    // set by the audio thread
+    std::atomic<uint32> tailSamples {0};
+    // Tail last reported to the host,
+    // audio thread only
+    uint32 tailReported = 0;
 
     int32_t bufsize = 8192;
-
-    std::vector<float> drybuf_l;     // Buffers for cabinet simulation bypass
-    std::vector<float> drybuf_r;
+    int32 maxBlockSize = 8192;
 
     std::vector<float> preamp_inp_buf;  // Buffers for preamp convolver
     std::vector<float> preamp_outp_buf;
+
+    std::vector<float> drybuf;          // Mono amp output, cabinet input
+    std::vector<float> fadebuf;         // Outgoing preamp output during crossfade
+
+    std::vector<float> fade_in_gain;    // Crossfade gains of the
+    std::vector<float> fade_out_gain;   // current chain call
   };
 
   //------------------------------------------------------------------------
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef PROFILELOADER_H
+#define PROFILELOADER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kpp_tubeamp.h"
+#include "ircache.h"
+#include "tapffile.h"
+
+// Zita-convolver parameters
+#define CONVPROC_SCHEDULER_PRIORITY 0
+#define CONVPROC_SCHEDULER_CLASS SCHED_FIFO
+#define THREAD_SYNC_MODE true
+
+// Convolver worker pool shared by all instances,
+// 0 threads is one per core
+#define CONVPROC_POOL_THREADS 0
+#define CONVPROC_POOL_AFFINITY false
+
+// Default length of the crossfade
+// between profiles, in milliseconds
+#define PROFILE_CROSSFADE_TIME 200
+
+// Loader thread looks for retired profiles
+// and cabinet flush requests this often,
+// in milliseconds
+#define LOADER_POLL_TIME 50
+
+// Cabinet convolver states, see
+// ProfileLoader::flush_cabinet()
+enum
+{
+  CABINET_RUNNING,
+  CABINET_STOPPED,
+  CABINET_FLUSHED
+};
+
+// Loaded *.tapf profile with
+// running convolvers
+struct stProfile
+{
+  std::string path;
+  st_profile_header header;
+
+  // Mapped 48000 Hz IRs, kept to rebuild
+  // the profile at another sample rate
+  std::shared_ptr<const TapfFile> master;
+
+  // Declared before the convolvers,
+  // so it outlives them
+  std::shared_ptr<const stIrData> ir;
+
+  Convproc preamp_convproc;
+  Convproc convproc;
+
+  // Time the audio thread spent running this
+  // profile as the outgoing one of a crossfade
+  int64_t fade_time_ns = 0;
+
+  // Cabinet convolver is stopped by the audio thread
+  // while unused and restarted with cleared history
+  // by the loader thread
+  std::atomic<int> cabinet_state {CABINET_RUNNING};
+
+  // Share of the cabinet output in its wet signal,
+  // ramps up from 0 after a flush. Used by whichever
+  // thread runs the cabinet stage.
+  float cabinet_ramp = 1.0;
+
+  // Convolver threads stopped while processing is
+  // off, under the loader mutex
+  bool suspended = false;
+};
+
+// Loads profiles on its own thread
+// and hands them over to the audio thread
+// without locks.
+//
+// Message thread calls request(),
+// audio thread calls acquire() to take a loaded
+// profile and retire() to give back one it
+// no longer uses. Retired profiles are deleted
+// here, never on the audio thread.
+class ProfileLoader
+{
+public:
+  ProfileLoader() {}
+  ~ProfileLoader();
+
+  void start();
+  void stop();
+
+  // Queue loading of the profile at 'path'.
+  // Only the latest request is kept. 'master' is
+  // the already mapped file at 'path', if any.
+  void request(const std::string &path, float sampleRate,
+               const stIrOptions &options,
+               std::shared_ptr<const TapfFile> master = nullptr);
+
+  // Audio thread: returns the freshly loaded
+  // profile or nullptr. A profile for another
+  // sample rate or with a partition above
+  // 'maxPartition' is left for drop_stale().
+  stProfile* acquire(float sampleRate, uint32_t maxPartition);
+
+  // Message thread: deletes a loaded profile not
+  // taken yet if it does not match 'sampleRate'
+  // and 'options', while the audio thread is stopped
+  void drop_stale(float sampleRate, const stIrOptions &options);
+
+  // Audio thread: passes 'old' back for deletion.
+  // Returns false if the previous one is not deleted
+  // yet, the caller should try again next block.
+  bool retire(stProfile *old);
+
+  // Message thread: loads the profile on the calling
+  // thread and returns it, like taken with acquire().
+  // Pending requests are dropped.
+  stProfile* load_now(const std::string &path, float sampleRate,
+                      const stIrOptions &options,
+                      std::shared_ptr<const TapfFile> master = nullptr);
+
+  // Message thread: deletes a profile taken with
+  // acquire() while the audio thread is stopped.
+  void release(stProfile *old);
+
+  // Audio thread: marks the cabinet convolver of
+  // 'profile' stopped, without locks or system calls.
+  // The loader thread polls for it, restarts it with
+  // cleared history and sets CABINET_FLUSHED.
+  static void flush_cabinet(stProfile *profile);
+
+  // Message thread: stop convolver threads of an
+  // inactive profile, and restart them with
+  // cleared state when processing resumes
+  void suspend(stProfile *profile);
+  void resume(stProfile *profile);
+
+  static bool check_profile_file(const char *path);
+  static stProfile* load_profile(const char *path, float sampleRate,
+                                 const stIrOptions &options,
+                                 std::shared_ptr<const TapfFile> master = nullptr);
+
+private:
+  void run();
+  void reclaim();
+  void flush_cabinets();
+  void unpublish(stProfile *profile);
+  void restart(Convproc *convproc);
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  bool quit = false;
+  bool requested = false;
+  std::string requestPath;
+  float requestRate = 48000.0;
+  stIrOptions requestOptions;
+  std::shared_ptr<const TapfFile> requestMaster;
+  // Counts requests, a load finished after
+  // a newer request is thrown away
+  uint32_t generation = 0;
+
+  // Published profiles not deleted yet,
+  // polled for cabinet flush requests
+  std::vector<stProfile*> published;
+
+  // Loaded profile waiting for the audio thread
+  std::atomic<stProfile*> ready {nullptr};
+  // Profile released by the audio thread
+  std::atomic<stProfile*> retired {nullptr};
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef TAPFFILE_H
+#define TAPFFILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "kpp_tubeamp.h"
+
+// Read-only memory mapping of a *.tapf
+// profile file. The whole layout is validated
+// in open(), after that the headers and IR
+// samples are used in place, without copies.
+class TapfFile
+{
+public:
+  TapfFile() {}
+  ~TapfFile();
+
+  TapfFile(const TapfFile&) = delete;
+  TapfFile& operator=(const TapfFile&) = delete;
+
+  // Maps the file at 'path', returns false if it
+  // can not be mapped or is not a valid profile
+  bool open(const char *path);
+  void close();
+
+  // Whole file contents
+  const char *data = nullptr;
+  size_t size = 0;
+
+  const st_profile_header *header = nullptr;
+
+  // 48000 Hz IRs, point into the mapping
+  const float *preamp_impulse = nullptr;
+  const float *left_impulse = nullptr;
+  const float *right_impulse = nullptr;
+
+  uint32_t preamp_count = 0;
+  uint32_t cabinet_count = 0;
+
+private:
+  bool validate();
+
+#ifdef _WIN32
+  void *file = nullptr;
+  void *mapping = nullptr;
+#endif
+};
+
+#endif
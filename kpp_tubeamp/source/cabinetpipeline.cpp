@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#include "../include/cabinetpipeline.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+CabinetPipeline::~CabinetPipeline()
+{
+  stop();
+}
+
+void CabinetPipeline::start(int bufsize, int latency, std::function<void()> work)
+{
+  stop();
+
+  for (int i = 0; i < 2; i++)
+  {
+    ampbuf[i].assign(bufsize, 0.0);
+  }
+  out_l.assign(bufsize, 0.0);
+  out_r.assign(bufsize, 0.0);
+  fade_in.assign(bufsize, 0.0);
+  fade_out.assign(bufsize, 0.0);
+  side = 0;
+  job = stCabinetJob();
+
+  // Delayed output is read while the
+  // next chain calls are written
+  uint32_t size = 1;
+  while (size < (uint32_t)(latency + 2 * bufsize))
+  {
+    size <<= 1;
+  }
+  ring_l.assign(size, 0.0);
+  ring_r.assign(size, 0.0);
+  mask = size - 1;
+  delay = latency;
+  writePos = latency;
+  readPos = 0;
+
+  this->work = work;
+  quit = false;
+  busy = false;
+  finished = false;
+  thread = std::thread(&CabinetPipeline::run, this);
+
+#ifndef _WIN32
+  // Same class as the convolver level threads
+  sched_param param;
+  param.sched_priority = sched_get_priority_min(CONVPROC_SCHEDULER_CLASS);
+  pthread_setschedparam(thread.native_handle(), CONVPROC_SCHEDULER_CLASS, &param);
+#endif
+}
+
+void CabinetPipeline::stop()
+{
+  if (thread.joinable())
+  {
+    wait();
+    quit = true;
+    trig.post();
+    thread.join();
+  }
+  finished = false;
+}
+
+void CabinetPipeline::post()
+{
+  side ^= 1;
+  busy = true;
+  trig.post();
+}
+
+void CabinetPipeline::wait()
+{
+  if (busy)
+  {
+    done.wait();
+    busy = false;
+    finished = true;
+  }
+}
+
+void CabinetPipeline::push()
+{
+  if (finished)
+  {
+    push(out_l.data(), out_r.data(), job.count);
+    finished = false;
+  }
+}
+
+void CabinetPipeline::push(const float *left, const float *right, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    ring_l[(writePos + i) & mask] = left[i];
+    ring_r[(writePos + i) & mask] = right[i];
+  }
+  writePos += count;
+}
+
+void CabinetPipeline::pull(float *left, float *right, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    left[i] = ring_l[(readPos + i) & mask];
+  }
+  // Same buffer as 'left' on mono buses
+  for (int i = 0; i < count; i++)
+  {
+    right[i] = ring_r[(readPos + i) & mask];
+  }
+  readPos += count;
+}
+
+void CabinetPipeline::run()
+{
+  while (true)
+  {
+    trig.wait();
+    if (quit)
+    {
+      break;
+    }
+
+    work();
+    done.post();
+  }
+}
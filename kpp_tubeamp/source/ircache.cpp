@@ -0,0 +1,814 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#include "../include/ircache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include "../thirdparty/zita-resampler/resampler.h"
+
+std::mutex IrCache::mutex;
+std::map<IrCache::Key, std::weak_ptr<IrCache::Entry>> IrCache::entries;
+
+// Partition layout, the same for the cached
+// convolvers and the instance ones sharing them
+static void configure_convolvers(const stIrData &ir,
+                                 Convproc *preamp_convproc, Convproc *convproc)
+{
+  // Partition doubles at most MAXLEV - 1 times,
+  // small heads need a smaller largest partition.
+  // With one partition size there is only one level,
+  // processed inline by Convproc::process().
+  uint32_t maxpart = std::min((uint32_t)Convproc::MAXPART,
+                              ir.partition << (Convproc::MAXLEV - 1));
+  if (ir.options.uniform)
+  {
+    maxpart = ir.partition;
+  }
+
+  // Split spectra for the SIMD multiply-accumulate,
+  // ignored without ENABLE_VECTOR_MODE
+  uint32_t options = Convproc::OPT_VECTOR_MODE;
+  if (ir.options.half_spectra)
+  {
+    options |= Convproc::OPT_HALF_SPECTRA;
+  }
+  preamp_convproc->set_options (options);
+  convproc->set_options (options);
+
+  preamp_convproc->configure (1, 1, ir.preamp_size,
+                              ir.partition, ir.partition, maxpart, 0.0);
+  convproc->configure (1, ir.cabinet_outputs, ir.cabinet_size,
+                       ir.partition, ir.partition, maxpart, 0.0);
+}
+
+static bool read_file(const char *path, std::vector<char> &data)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return false;
+  }
+
+  bool status = false;
+  if (fseek(file, 0, SEEK_END) == 0)
+  {
+    long size = ftell(file);
+    if ((size > 0) && (fseek(file, 0, SEEK_SET) == 0))
+    {
+      data.resize(size);
+      status = (fread(data.data(), 1, size, file) == (size_t)size);
+    }
+  }
+
+  fclose(file);
+  return status;
+}
+
+// 64-bit FNV-1a
+static uint64_t content_hash(const char *data, size_t size,
+                             uint64_t hash = 14695981039346656037ULL)
+{
+  for (size_t i = 0; i < size; i++)
+  {
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Resamples 48000 Hz IRs from 'tapf' to 'sampleRate'
+// with Zita-resampler
+static void resample_impulses(const TapfFile &tapf, float sampleRate,
+                              std::vector<float> &preamp_impulse,
+                              std::vector<float> &left_impulse,
+                              std::vector<float> &right_impulse)
+{
+  float ratio = (float)sampleRate / 48000.0;
+  int preamp_count = tapf.preamp_count;
+  int cabinet_count = tapf.cabinet_count;
+
+  {
+    Resampler resampl;
+    resampl.setup(48000,sampleRate,1,48);
+
+    int k = resampl.inpsize();
+
+    std::vector<float> preamp_in(preamp_count + k/2 - 1 + k - 1);
+    std::vector<float> preamp_out((unsigned int)((preamp_count + k/2 - 1 + k - 1)*ratio));
+
+    // Create paddig before and after signal, needed for zita-resampler
+    for (int i = 0; i < preamp_count + k/2 - 1 + k - 1; i++)
+    {
+      preamp_in[i] = 0.0;
+    }
+
+    for (int i = k/2 - 1; i < preamp_count + k/2 - 1; i++)
+    {
+      preamp_in[i] = tapf.preamp_impulse[i - k/2 + 1];
+    }
+
+    resampl.inp_count = preamp_count + k/2 - 1 + k - 1;
+    resampl.out_count = (unsigned int)((preamp_count + k/2 - 1 + k - 1)*ratio);
+    resampl.inp_data = preamp_in.data();
+    resampl.out_data = preamp_out.data();
+
+    resampl.process();
+
+    preamp_impulse.resize(preamp_count * ratio);
+    for (unsigned int i = 0; i < (unsigned int)(preamp_count*ratio); i++)
+    {
+      preamp_impulse[i] = preamp_out[i] / ratio;
+    }
+  }
+
+  {
+    Resampler resampl;
+    resampl.setup(48000,sampleRate,2,48);
+
+    int k = resampl.inpsize();
+
+    std::vector<float> inp_data((cabinet_count + k/2 - 1 + k - 1)*2);
+
+    // Create paddig before and after signal, needed for zita-resampler
+    for (int i = 0; i < cabinet_count + k/2 - 1 + k - 1; i++)
+    {
+      inp_data[i*2] = 0.0;
+      inp_data[i*2+1] = 0.0;
+    }
+
+    for (int i = k/2 - 1; i < cabinet_count + k/2 - 1; i++)
+    {
+      inp_data[i*2] = tapf.left_impulse[i-k/2+1];
+      inp_data[i*2+1] = tapf.right_impulse[i-k/2+1];
+    }
+
+    std::vector<float> out_data((unsigned int)((cabinet_count + k/2 - 1 + k - 1)*ratio*2));
+
+    resampl.inp_count = cabinet_count + k/2 - 1 + k - 1;
+    resampl.out_count = (unsigned int)((cabinet_count + k/2 - 1 + k - 1)*ratio);
+    resampl.inp_data = inp_data.data();
+    resampl.out_data = out_data.data();
+
+    resampl.process();
+
+    left_impulse.resize((unsigned int)(cabinet_count * ratio));
+    right_impulse.resize((unsigned int)(cabinet_count * ratio));
+
+    for (unsigned int i = 0; i < (unsigned int)(cabinet_count*ratio); i++)
+    {
+      left_impulse[i] = out_data[i*2] / ratio;
+      right_impulse[i] = out_data[i*2+1] / ratio;
+    }
+  }
+}
+
+// Returns length of the stereo IR 'left'/'right'
+// without the tail whose energy is
+// IR_TRIM_THRESHOLD_DB below the total energy
+static uint32_t trimmed_length(const float *left, const float *right, uint32_t count)
+{
+  double total = 0.0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    total += left[i] * left[i] + right[i] * right[i];
+  }
+
+  double limit = total * pow(10.0, IR_TRIM_THRESHOLD_DB / 10.0);
+  double tail = 0.0;
+  uint32_t length = count;
+
+  while (length > 0)
+  {
+    double energy = left[length - 1] * left[length - 1] +
+                    right[length - 1] * right[length - 1];
+    if (tail + energy > limit)
+    {
+      break;
+    }
+    tail += energy;
+    length--;
+  }
+
+  return length;
+}
+
+// Replaces 'count' samples of 'impulse' with
+// the minimum phase IR of the same magnitude
+// response, computed by the cepstral method
+static void make_min_phase(float *impulse, uint32_t count)
+{
+  // Long transform keeps cepstrum aliasing low
+  uint32_t size = 1;
+  while (size < count * 8)
+  {
+    size <<= 1;
+  }
+
+  float *time_data = fftwf_alloc_real(size);
+  fftwf_complex *freq_data = fftwf_alloc_complex(size / 2 + 1);
+
+  pthread_mutex_lock(&zita_convolver_fftw_lock);
+  fftwf_plan plan_r2c = fftwf_plan_dft_r2c_1d(size, time_data, freq_data, FFTW_ESTIMATE);
+  fftwf_plan plan_c2r = fftwf_plan_dft_c2r_1d(size, freq_data, time_data, FFTW_ESTIMATE);
+  pthread_mutex_unlock(&zita_convolver_fftw_lock);
+
+  memcpy(time_data, impulse, count * sizeof(float));
+  memset(time_data + count, 0, (size - count) * sizeof(float));
+
+  fftwf_execute(plan_r2c);
+
+  // Log magnitude, floored 140 dB below peak
+  float peak = 0.0;
+  for (uint32_t i = 0; i <= size / 2; i++)
+  {
+    peak = std::max(peak, (float)hypot(freq_data[i][0], freq_data[i][1]));
+  }
+  float floor = std::max(peak * 1e-7f, 1e-30f);
+
+  for (uint32_t i = 0; i <= size / 2; i++)
+  {
+    float magnitude = hypot(freq_data[i][0], freq_data[i][1]);
+    freq_data[i][0] = log(std::max(magnitude, floor));
+    freq_data[i][1] = 0.0;
+  }
+
+  // Real cepstrum, folded onto positive time
+  fftwf_execute(plan_c2r);
+
+  time_data[0] /= size;
+  for (uint32_t i = 1; i < size / 2; i++)
+  {
+    time_data[i] *= 2.0 / size;
+  }
+  time_data[size / 2] /= size;
+  memset(time_data + size / 2 + 1, 0, (size / 2 - 1) * sizeof(float));
+
+  fftwf_execute(plan_r2c);
+
+  for (uint32_t i = 0; i <= size / 2; i++)
+  {
+    float magnitude = exp(freq_data[i][0]);
+    float phase = freq_data[i][1];
+    freq_data[i][0] = magnitude * cos(phase);
+    freq_data[i][1] = magnitude * sin(phase);
+  }
+
+  fftwf_execute(plan_c2r);
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    impulse[i] = time_data[i] / size;
+  }
+
+  pthread_mutex_lock(&zita_convolver_fftw_lock);
+  fftwf_destroy_plan(plan_r2c);
+  fftwf_destroy_plan(plan_c2r);
+  pthread_mutex_unlock(&zita_convolver_fftw_lock);
+
+  fftwf_free(time_data);
+  fftwf_free(freq_data);
+}
+
+// Resampled IRs are kept on disk, so
+// later loads at the same rate skip resampling
+typedef struct
+{
+  char signature[4];
+  uint32_t version;
+  uint64_t hash;
+  int32_t sample_rate;
+  uint32_t preamp_size;
+  uint32_t left_size;
+  uint32_t right_size;
+  // Hash of all samples after the header
+  uint64_t checksum;
+}st_resampled_header;
+
+static uint64_t samples_checksum(const float *preamp, size_t preamp_size,
+                                 const float *left, const float *right, size_t cabinet_size)
+{
+  uint64_t hash = content_hash((const char *)preamp, preamp_size * sizeof(float));
+  hash = content_hash((const char *)left, cabinet_size * sizeof(float), hash);
+  return content_hash((const char *)right, cabinet_size * sizeof(float), hash);
+}
+
+static std::string cache_dir()
+{
+  std::string dir;
+
+#ifdef _WIN32
+  const char *base = getenv("LOCALAPPDATA");
+  if (!base || !*base)
+  {
+    return "";
+  }
+  dir = std::string(base) + "\\kpp_tubeamp";
+  _mkdir(dir.c_str());
+#else
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && *xdg)
+  {
+    dir = xdg;
+  }
+  else if (home && *home)
+  {
+#ifdef __APPLE__
+    dir = std::string(home) + "/Library/Caches";
+#else
+    dir = std::string(home) + "/.cache";
+#endif
+  }
+  else
+  {
+    return "";
+  }
+  mkdir(dir.c_str(), 0755);
+  dir += "/kpp_tubeamp";
+  mkdir(dir.c_str(), 0755);
+#endif
+
+  return dir;
+}
+
+static std::string cache_path(uint64_t hash, float sampleRate)
+{
+  std::string dir = cache_dir();
+  if (dir == "")
+  {
+    return "";
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%d.irc", (unsigned long long)hash, (int)sampleRate);
+  return dir + name;
+}
+
+static bool load_resampled(uint64_t hash, float sampleRate,
+                           std::vector<float> &preamp_impulse, uint32_t preamp_size,
+                           std::vector<float> &left_impulse,
+                           std::vector<float> &right_impulse, uint32_t cabinet_size)
+{
+  std::string path = cache_path(hash, sampleRate);
+  std::vector<char> data;
+  if ((path == "") || !read_file(path.c_str(), data))
+  {
+    return false;
+  }
+
+  st_resampled_header header;
+  size_t floats = (size_t)preamp_size + 2 * (size_t)cabinet_size;
+  if (data.size() != sizeof(header) + floats * sizeof(float))
+  {
+    return false;
+  }
+
+  memcpy(&header, data.data(), sizeof(header));
+  if (strncmp(header.signature, "TaIr", 4) || (header.version != 2) ||
+      (header.hash != hash) || (header.sample_rate != (int32_t)sampleRate) ||
+      (header.preamp_size != preamp_size) ||
+      (header.left_size != cabinet_size) || (header.right_size != cabinet_size))
+  {
+    return false;
+  }
+
+  const float *samples = (const float *)(data.data() + sizeof(header));
+  if (samples_checksum(samples, preamp_size, samples + preamp_size,
+                       samples + preamp_size + cabinet_size, cabinet_size) != header.checksum)
+  {
+    return false;
+  }
+
+  // Recently used files are kept longest
+  utime(path.c_str(), NULL);
+
+  preamp_impulse.assign(samples, samples + preamp_size);
+  samples += preamp_size;
+  left_impulse.assign(samples, samples + cabinet_size);
+  samples += cabinet_size;
+  right_impulse.assign(samples, samples + cabinet_size);
+
+  return true;
+}
+
+struct stCacheFile
+{
+  std::string path;
+  int64_t size;
+  int64_t time;
+};
+
+// Removes least recently used files except 'keep' once
+// the cache directory holds more than IR_CACHE_MAX_SIZE bytes
+static void prune_cache(const std::string &keep)
+{
+  std::string dir = cache_dir();
+  if (dir == "")
+  {
+    return;
+  }
+
+  std::vector<stCacheFile> files;
+  int64_t total = 0;
+
+#ifdef _WIN32
+  struct _finddata64_t found;
+  intptr_t handle = _findfirst64((dir + "\\*.irc").c_str(), &found);
+  if (handle != -1)
+  {
+    do
+    {
+      files.push_back({dir + "\\" + found.name, found.size, found.time_write});
+    } while (_findnext64(handle, &found) == 0);
+    _findclose(handle);
+  }
+#else
+  DIR *handle = opendir(dir.c_str());
+  if (handle)
+  {
+    while (struct dirent *entry = readdir(handle))
+    {
+      std::string name = entry->d_name;
+      struct stat info;
+      if ((name.size() > 4) && (name.compare(name.size() - 4, 4, ".irc") == 0) &&
+          (stat((dir + "/" + name).c_str(), &info) == 0))
+      {
+        files.push_back({dir + "/" + name, (int64_t)info.st_size, (int64_t)info.st_mtime});
+      }
+    }
+    closedir(handle);
+  }
+#endif
+
+  for (const stCacheFile &file : files)
+  {
+    total += file.size;
+  }
+
+  std::sort(files.begin(), files.end(),
+            [](const stCacheFile &a, const stCacheFile &b) { return a.time < b.time; });
+
+  for (size_t i = 0; (i < files.size()) && (total > IR_CACHE_MAX_SIZE); i++)
+  {
+    if ((files[i].path != keep) && remove(files[i].path.c_str()) == 0)
+    {
+      total -= files[i].size;
+    }
+  }
+}
+
+static void store_resampled(uint64_t hash, float sampleRate,
+                            const std::vector<float> &preamp_impulse,
+                            const std::vector<float> &left_impulse,
+                            const std::vector<float> &right_impulse)
+{
+  std::string path = cache_path(hash, sampleRate);
+  if (path == "")
+  {
+    return;
+  }
+
+  st_resampled_header header;
+  memcpy(header.signature, "TaIr", 4);
+  header.version = 2;
+  header.hash = hash;
+  header.sample_rate = (int32_t)sampleRate;
+  header.preamp_size = preamp_impulse.size();
+  header.left_size = left_impulse.size();
+  header.right_size = right_impulse.size();
+  header.checksum = samples_checksum(preamp_impulse.data(), preamp_impulse.size(),
+                                     left_impulse.data(), right_impulse.data(),
+                                     left_impulse.size());
+
+  // Write to a temporary file and rename it,
+  // so other processes never read a partial file.
+  // Thread ids repeat across processes, the
+  // process id keeps names of parallel hosts apart.
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%ld.%lx.tmp", (long)getpid(),
+           (unsigned long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+  std::string tmp_path = path + suffix;
+
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+  if (file == NULL)
+  {
+    return;
+  }
+
+  bool status =
+    (fwrite(&header, sizeof(header), 1, file) == 1) &&
+    (fwrite(preamp_impulse.data(), sizeof(float), preamp_impulse.size(), file) == preamp_impulse.size()) &&
+    (fwrite(left_impulse.data(), sizeof(float), left_impulse.size(), file) == left_impulse.size()) &&
+    (fwrite(right_impulse.data(), sizeof(float), right_impulse.size(), file) == right_impulse.size());
+
+  if ((fclose(file) != 0) || !status || (rename(tmp_path.c_str(), path.c_str()) != 0))
+  {
+    remove(tmp_path.c_str());
+    return;
+  }
+
+  prune_cache(path);
+}
+
+// Resamples IRs of the validated profile 'tapf'
+// to 'sampleRate' and computes IR partitions
+// in the cached convolvers. At 48000 Hz IRs go
+// to the convolvers straight from the mapping.
+static std::shared_ptr<stIrData> build(const TapfFile &tapf, uint64_t hash,
+                                       float sampleRate, const stIrOptions &options)
+{
+  std::shared_ptr<stIrData> ir = std::make_shared<stIrData>();
+  ir->header = *tapf.header;
+  ir->sample_rate = sampleRate;
+  ir->partition = options.partition;
+  ir->options = options;
+
+  // IRs in *.tapf are 48000 Hz,
+  // calculate ratio for resampling
+  float ratio = (float)sampleRate / 48000.0;
+
+  const float *preamp_data = tapf.preamp_impulse;
+  const float *left_data = tapf.left_impulse;
+  const float *right_data = tapf.right_impulse;
+  uint32_t preamp_count = tapf.preamp_count;
+  uint32_t cabinet_count = tapf.cabinet_count;
+
+  std::vector<float> preamp_impulse;
+  std::vector<float> left_impulse;
+  std::vector<float> right_impulse;
+
+  // If current rate is not 48000 Hz do resampling,
+  // or read IRs resampled by an earlier load
+  if (sampleRate!=48000)
+  {
+    preamp_count = (unsigned int)(tapf.preamp_count*ratio);
+    cabinet_count = (unsigned int)(tapf.cabinet_count*ratio);
+
+    if (!load_resampled(hash, sampleRate, preamp_impulse, preamp_count,
+                        left_impulse, right_impulse, cabinet_count))
+    {
+      resample_impulses(tapf, sampleRate, preamp_impulse, left_impulse, right_impulse);
+      store_resampled(hash, sampleRate, preamp_impulse, left_impulse, right_impulse);
+    }
+
+    preamp_data = preamp_impulse.data();
+    left_data = left_impulse.data();
+    right_data = right_impulse.data();
+  }
+
+  // Cabinet IR is cut to IR_CABINET_MAX_TIME
+  // at most, and to its audible part
+  ir->preamp_size = preamp_count;
+  ir->cabinet_size = std::min(cabinet_count, (uint32_t)(sampleRate * IR_CABINET_MAX_TIME));
+
+  // Minimum phase IR has its energy up front,
+  // so it is trimmed much shorter below
+  if (options.min_phase)
+  {
+    if (left_data != left_impulse.data())
+    {
+      left_impulse.assign(left_data, left_data + ir->cabinet_size);
+      right_impulse.assign(right_data, right_data + ir->cabinet_size);
+      left_data = left_impulse.data();
+      right_data = right_impulse.data();
+    }
+
+    make_min_phase(left_impulse.data(), ir->cabinet_size);
+    make_min_phase(right_impulse.data(), ir->cabinet_size);
+  }
+
+  uint32_t fade_length = sampleRate * IR_TRIM_FADE_TIME;
+  uint32_t cabinet_size = std::min(ir->cabinet_size,
+    trimmed_length(left_data, right_data, ir->cabinet_size) + fade_length);
+
+  if (cabinet_size < ir->cabinet_size)
+  {
+    ir->cabinet_size = cabinet_size;
+    fade_length = std::min(fade_length, cabinet_size);
+
+    // IRs in the mapping are read-only
+    if (left_data != left_impulse.data())
+    {
+      left_impulse.assign(left_data, left_data + cabinet_size);
+      right_impulse.assign(right_data, right_data + cabinet_size);
+      left_data = left_impulse.data();
+      right_data = right_impulse.data();
+    }
+
+    for (uint32_t i = 0; i < fade_length; i++)
+    {
+      float gain = 0.5 * (1.0 + cos(M_PI * (i + 1) / fade_length));
+      left_impulse[cabinet_size - fade_length + i] *= gain;
+      right_impulse[cabinet_size - fade_length + i] *= gain;
+    }
+  }
+
+  if ((ir->preamp_size == 0) || (ir->cabinet_size == 0))
+  {
+    return nullptr;
+  }
+
+  // Most profiles have the same IR in both channels
+  if (!memcmp(left_data, right_data, ir->cabinet_size * sizeof(float)))
+  {
+    ir->cabinet_outputs = 1;
+  }
+
+  configure_convolvers(*ir, &ir->preamp_convproc, &ir->convproc);
+
+  ir->preamp_convproc.impdata_create (0, 0, 1, (float *)preamp_data,
+                                      0, ir->preamp_size);
+
+  ir->convproc.impdata_create (0, 0, 1, (float *)left_data, 0, ir->cabinet_size);
+  if (ir->cabinet_outputs == 2)
+  {
+    ir->convproc.impdata_create (0, 1, 1, (float *)right_data, 0, ir->cabinet_size);
+  }
+
+  return ir;
+}
+
+std::shared_ptr<const stIrData> IrCache::get(const TapfFile &tapf, float sampleRate,
+                                             const stIrOptions &options)
+{
+  uint64_t hash = content_hash(tapf.data, tapf.size);
+  Key key(hash, (int)sampleRate, options.partition, options.min_phase, options.uniform,
+          options.half_spectra);
+
+  std::shared_ptr<Entry> entry;
+  std::unique_lock<std::mutex> entryLock;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+      if (it->second.expired())
+      {
+        it = entries.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+      entry = it->second.lock();
+    }
+
+    if (!entry)
+    {
+      // Lock the new entry before publishing it,
+      // other instances wait below until it is built
+      entry = std::make_shared<Entry>();
+      entryLock = std::unique_lock<std::mutex>(entry->mutex);
+      entries[key] = entry;
+    }
+  }
+
+  if (!entryLock.owns_lock())
+  {
+    entryLock = std::unique_lock<std::mutex>(entry->mutex);
+  }
+
+  if (!entry->ir)
+  {
+    entry->ir = build(tapf, hash, sampleRate, options);
+  }
+
+  if (!entry->ir)
+  {
+    return nullptr;
+  }
+
+  // Keeps the entry alive together with the IR data
+  return std::shared_ptr<const stIrData>(entry, entry->ir.get());
+}
+
+bool IrCache::attach(const stIrData &ir, Convproc *preamp_convproc, Convproc *convproc)
+{
+  configure_convolvers(ir, preamp_convproc, convproc);
+
+  return (preamp_convproc->impdata_share(&ir.preamp_convproc, 0, 0) == 0)
+      && (convproc->impdata_share(&ir.convproc, 0, 0) == 0)
+      && ((ir.cabinet_outputs == 1) || (convproc->impdata_share(&ir.convproc, 0, 1) == 0));
+}
+
+// Feeds the same noise to both convolvers for 'length'
+// samples, returns peak and RMS of their output difference
+// relative to the RMS of the 'full' output
+static void null_error(Convproc *full, Convproc *half, uint32_t outputs,
+                       uint32_t partition, uint32_t length,
+                       double &peak_db, double &rms_db)
+{
+  uint32_t seed = 1;
+  double peak = 0.0;
+  double error = 0.0;
+  double energy = 0.0;
+
+  for (uint32_t done = 0; done < length; done += partition)
+  {
+    float *in_full = full->inpdata(0);
+    float *in_half = half->inpdata(0);
+    for (uint32_t i = 0; i < partition; i++)
+    {
+      seed = seed * 1664525 + 1013904223;
+      in_full[i] = in_half[i] = (float)(int32_t)seed / 2147483648.0f;
+    }
+
+    full->process(true);
+    half->process(true);
+
+    for (uint32_t k = 0; k < outputs; k++)
+    {
+      const float *out_full = full->outdata(k);
+      const float *out_half = half->outdata(k);
+      for (uint32_t i = 0; i < partition; i++)
+      {
+        double d = out_half[i] - out_full[i];
+        peak = std::max(peak, std::fabs(d));
+        error += d * d;
+        energy += (double)out_full[i] * out_full[i];
+      }
+    }
+  }
+
+  double rms = std::sqrt(energy / ((double)length * outputs));
+  peak_db = 20.0 * std::log10(peak / rms);
+  rms_db = 10.0 * std::log10(error / energy);
+}
+
+bool IrCache::null_test(const TapfFile &tapf, float sampleRate,
+                        stIrOptions options, stNullTest &result)
+{
+  // A single level, both variants run on this thread
+  options.uniform = true;
+  options.half_spectra = false;
+  std::shared_ptr<const stIrData> full = get(tapf, sampleRate, options);
+  options.half_spectra = true;
+  std::shared_ptr<const stIrData> half = get(tapf, sampleRate, options);
+  if (!full || !half)
+  {
+    return false;
+  }
+
+  Convproc full_preamp, full_cabinet;
+  Convproc half_preamp, half_cabinet;
+  if (!attach(*full, &full_preamp, &full_cabinet) ||
+      !attach(*half, &half_preamp, &half_cabinet))
+  {
+    return false;
+  }
+
+  full_preamp.start_process(0, SCHED_OTHER);
+  full_cabinet.start_process(0, SCHED_OTHER);
+  half_preamp.start_process(0, SCHED_OTHER);
+  half_cabinet.start_process(0, SCHED_OTHER);
+
+  // Long enough to reach the end of the IRs
+  uint32_t length = std::max(full->preamp_size, full->cabinet_size) + (uint32_t)sampleRate;
+
+  null_error(&full_preamp, &half_preamp, 1, full->partition, length,
+             result.preamp_peak_db, result.preamp_rms_db);
+  null_error(&full_cabinet, &half_cabinet, full->cabinet_outputs, full->partition, length,
+             result.cabinet_peak_db, result.cabinet_rms_db);
+
+  return true;
+}
@@ -36,12 +36,16 @@
 
 #include "../include/plugcontroller.h"
 #include "../include/plugids.h"
+#include "../include/profileloader.h"
 #include "pluginterfaces/base/ustring.h"
 
 #include "base/source/fstreamer.h"
 #include "base/source/fstring.h"
 #include "pluginterfaces/base/ibstream.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include "../include/pluguimessagecontroller.h"
 
 using namespace VSTGUI;
@@ -134,6 +138,25 @@ namespace Vst {
     return false;
   }
 
+  // Convolver head partition choices, in samples,
+  // 0 is Auto, matched to the host block size
+  static const int32 partitionSizes[] = {0, 16, 32, 64, 128, 256};
+  static const int32 numPartitionSizes = sizeof(partitionSizes) / sizeof(partitionSizes[0]);
+
+  static int32 partitionIndex (ParamValue value)
+  {
+    return std::min ((int32)(value * (numPartitionSizes - 1) + 0.5), numPartitionSizes - 1);
+  }
+
+  // Profile crossfade choices, in milliseconds
+  static const int32 crossfadeTimes[] = {50, 100, 200, 500, 1000};
+  static const int32 numCrossfadeTimes = sizeof(crossfadeTimes) / sizeof(crossfadeTimes[0]);
+
+  static int32 crossfadeIndex (ParamValue value)
+  {
+    return std::min ((int32)(value * (numCrossfadeTimes - 1) + 0.5), numCrossfadeTimes - 1);
+  }
+
   tresult PLUGIN_API PlugController::initialize (FUnknown* context)
   {
     tresult result = EditControllerEx1::initialize (context);
@@ -165,6 +188,65 @@ namespace Vst {
       parameters.addParameter (STR16 ("Cabinet"), NULL, 0, 1.0,
                                ParameterInfo::kCanAutomate, kCabinetId, 0,
                                STR16 ("Cabinet"));
+
+      // Changing it reloads the profile,
+      // so it is not automatable
+      parameters.addParameter (STR16 ("Min Phase"), nullptr, 1, 0,
+                               ParameterInfo::kNoFlags, kMinPhaseId);
+
+      // Latency and CPU load trade-off, rebuilds
+      // the convolvers, not automatable either
+      StringListParameter* partitionParam = new StringListParameter (
+        STR16 ("Partition"), kPartitionId, STR16 ("samples"), ParameterInfo::kIsList);
+      partitionParam->appendString (STR16 ("Auto"));
+      for (int32 i = 1; i < numPartitionSizes; i++)
+      {
+        char text[16];
+        sprintf (text, "%d", partitionSizes[i]);
+        partitionParam->appendString (UString128 (text));
+      }
+      parameters.addParameter (partitionParam);
+
+      // Cabinet on a second thread, one more block
+      // of latency, applied on the next activation
+      parameters.addParameter (STR16 ("Pipeline"), nullptr, 1, 0,
+                               ParameterInfo::kNoFlags, kPipelineId);
+
+      // Overlap of the old and the new profile
+      // when another one is loaded
+      StringListParameter* crossfadeParam = new StringListParameter (
+        STR16 ("Crossfade"), kCrossfadeId, STR16 ("ms"), ParameterInfo::kIsList);
+      int32 crossfadeDefault = 0;
+      for (int32 i = 0; i < numCrossfadeTimes; i++)
+      {
+        char text[16];
+        sprintf (text, "%d", crossfadeTimes[i]);
+        crossfadeParam->appendString (UString128 (text));
+        if (crossfadeTimes[i] == PROFILE_CROSSFADE_TIME)
+          crossfadeDefault = i;
+      }
+      crossfadeParam->getInfo ().defaultNormalizedValue =
+        (ParamValue)crossfadeDefault / (numCrossfadeTimes - 1);
+      crossfadeParam->setNormalized (crossfadeParam->getInfo ().defaultNormalizedValue);
+      parameters.addParameter (crossfadeParam);
+
+      // Extra CPU load of the last crossfade,
+      // set by the processor
+      parameters.addParameter (new RangeParameter (
+        STR16 ("Crossfade Load"), kCrossfadeLoadId, STR16 ("%"),
+        0, 100, 0, 0, ParameterInfo::kIsReadOnly));
+
+      // Latency changed on the audio thread,
+      // set by the processor
+      parameters.addParameter (STR16 ("Latency"), nullptr, 0, 0,
+                               ParameterInfo::kIsReadOnly | ParameterInfo::kIsHidden,
+                               kLatencyId);
+
+      // Tail changed with the profile
+      // or the latency, set by the processor
+      parameters.addParameter (STR16 ("Tail"), nullptr, 0, 0,
+                               ParameterInfo::kIsReadOnly | ParameterInfo::kIsHidden,
+                               kTailId);
     }
     return kResultTrue;
   }
@@ -240,6 +322,37 @@ namespace Vst {
       return kResultFalse;
     setParamNormalized (kBypassId, bypassState ? 1 : 0);
 
+    // Profile path is restored by setState(),
+    // states saved before Min Phase end here
+    char8* savedPath = streamer.readStr8 ();
+    delete[] savedPath;
+
+    int32 savedMinPhase = 0;
+    if (streamer.readInt32 (savedMinPhase) == false)
+      savedMinPhase = 0;
+    setParamNormalized (kMinPhaseId, savedMinPhase ? 1 : 0);
+
+    int32 savedPartition = 0;
+    if (streamer.readInt32 (savedPartition) == false)
+      savedPartition = 0;
+    int32 index = 0;
+    while ((index < numPartitionSizes - 1) && (partitionSizes[index] < savedPartition))
+      index++;
+    setParamNormalized (kPartitionId, (ParamValue)index / (numPartitionSizes - 1));
+
+    int32 savedPipeline = 0;
+    if (streamer.readInt32 (savedPipeline) == false)
+      savedPipeline = 0;
+    setParamNormalized (kPipelineId, savedPipeline ? 1 : 0);
+
+    int32 savedCrossfade = PROFILE_CROSSFADE_TIME;
+    if (streamer.readInt32 (savedCrossfade) == false)
+      savedCrossfade = PROFILE_CROSSFADE_TIME;
+    index = 0;
+    while ((index < numCrossfadeTimes - 1) && (crossfadeTimes[index] < savedCrossfade))
+      index++;
+    setParamNormalized (kCrossfadeId, (ParamValue)index / (numCrossfadeTimes - 1));
+
     return kResultOk;
   }
 
@@ -259,10 +372,97 @@ namespace Vst {
 
   tresult PLUGIN_API PlugController::setParamNormalized (ParamID tag, ParamValue value)
   {
+    bool minPhaseChanged = (tag == kMinPhaseId) &&
+      ((getParamNormalized (tag) > 0.5) != (value > 0.5));
+
+    bool partitionChanged = (tag == kPartitionId) &&
+      (partitionIndex (getParamNormalized (tag)) != partitionIndex (value));
+
+    bool pipelineChanged = (tag == kPipelineId) &&
+      ((getParamNormalized (tag) > 0.5) != (value > 0.5));
+
+    bool crossfadeChanged = (tag == kCrossfadeId) &&
+      (crossfadeIndex (getParamNormalized (tag)) != crossfadeIndex (value));
+
+    bool latencyChanged = (tag == kLatencyId) &&
+      (getParamNormalized (tag) != value);
+
+    bool tailChanged = (tag == kTailId) &&
+      (getParamNormalized (tag) != value);
+
     tresult result = EditControllerEx1::setParamNormalized (tag, value);
+
+    if (latencyChanged && componentHandler)
+    {
+      componentHandler->restartComponent (kLatencyChanged);
+    }
+
+    // Host queries getTailSamples() again
+    if (tailChanged && componentHandler)
+    {
+      componentHandler->restartComponent (kIoChanged);
+    }
+
+    // Processor rebuilds IRs on the message thread,
+    // not from process()
+    if (minPhaseChanged)
+    {
+      if (IPtr<IMessage> message = owned (allocateMessage ()))
+      {
+        message->setMessageID ("MinPhase");
+        message->getAttributes ()->setInt ("value", value > 0.5 ? 1 : 0);
+        sendMessage (message);
+      }
+    }
+
+    if (partitionChanged)
+    {
+      if (IPtr<IMessage> message = owned (allocateMessage ()))
+      {
+        message->setMessageID ("Partition");
+        message->getAttributes ()->setInt ("value", partitionSizes[partitionIndex (value)]);
+        sendMessage (message);
+      }
+    }
+
+    if (pipelineChanged)
+    {
+      if (IPtr<IMessage> message = owned (allocateMessage ()))
+      {
+        message->setMessageID ("Pipeline");
+        message->getAttributes ()->setInt ("value", value > 0.5 ? 1 : 0);
+        sendMessage (message);
+      }
+    }
+
+    if (crossfadeChanged)
+    {
+      if (IPtr<IMessage> message = owned (allocateMessage ()))
+      {
+        message->setMessageID ("Crossfade");
+        message->getAttributes ()->setInt ("value", crossfadeTimes[crossfadeIndex (value)]);
+        sendMessage (message);
+      }
+    }
+
     return result;
   }
 
+  tresult PLUGIN_API PlugController::notify (IMessage* message)
+  {
+    // Processor latency depends on the processing mode
+    if (message && !strcmp (message->getMessageID (), "Latency"))
+    {
+      if (componentHandler)
+      {
+        componentHandler->restartComponent (kLatencyChanged);
+      }
+      return kResultOk;
+    }
+
+    return EditControllerEx1::notify (message);
+  }
+
   tresult PLUGIN_API PlugController::getParamStringByValue (ParamID tag, ParamValue valueNormalized,
                                                             String128 string)
   {
@@ -41,29 +41,54 @@
 #include "pluginterfaces/base/ibstream.h"
 #include "pluginterfaces/vst/ivstparameterchanges.h"
 
-// Zita-convolver parameters
-#define CONVPROC_SCHEDULER_PRIORITY 0
-#define CONVPROC_SCHEDULER_CLASS SCHED_FIFO
-#define THREAD_SYNC_MODE true
-
-#define fragm 64
-
-#define HAVE_STRUCT_TIMESPEC
-#include "../thirdparty/zita-resampler/resampler.h"
-#include "../thirdparty/zita-convolver/zita-convolver.h"
-
-struct stProfile
-{
-  std::string path;
-  st_profile_header header;
-  Convproc preamp_convproc;
-  Convproc convproc;
-};
-
+#include <chrono>
+#include <cmath>
 
 namespace Steinberg {
 namespace Vst {
 
+  // Nearest supported partition size
+  static uint32_t valid_partition(int64 size)
+  {
+    uint32_t partition = PARTITION_MIN;
+    while ((partition < PARTITION_MAX) && (partition < size))
+    {
+      partition <<= 1;
+    }
+    return partition;
+  }
+
+  // Amp parameters of 'from' moved towards
+  // those of 'to' by 'mix', 0 to 1
+  static void mix_header(st_profile_header &dst, const st_profile_header &from,
+                         const st_profile_header &to, float mix)
+  {
+    auto ramp = [mix](float a, float b) { return a + (b - a) * std::min(mix, 1.0f); };
+
+    dst = to;
+    dst.preamp_level = ramp(from.preamp_level, to.preamp_level);
+    dst.preamp_bias = ramp(from.preamp_bias, to.preamp_bias);
+    dst.preamp_Kreg = ramp(from.preamp_Kreg, to.preamp_Kreg);
+    dst.preamp_Upor = ramp(from.preamp_Upor, to.preamp_Upor);
+
+    dst.tonestack_low_freq = ramp(from.tonestack_low_freq, to.tonestack_low_freq);
+    dst.tonestack_low_band = ramp(from.tonestack_low_band, to.tonestack_low_band);
+    dst.tonestack_middle_freq = ramp(from.tonestack_middle_freq, to.tonestack_middle_freq);
+    dst.tonestack_middle_band = ramp(from.tonestack_middle_band, to.tonestack_middle_band);
+    dst.tonestack_high_freq = ramp(from.tonestack_high_freq, to.tonestack_high_freq);
+    dst.tonestack_high_band = ramp(from.tonestack_high_band, to.tonestack_high_band);
+
+    dst.amp_level = ramp(from.amp_level, to.amp_level);
+    dst.amp_bias = ramp(from.amp_bias, to.amp_bias);
+    dst.amp_Kreg = ramp(from.amp_Kreg, to.amp_Kreg);
+    dst.amp_Upor = ramp(from.amp_Upor, to.amp_Upor);
+
+    dst.sag_time = ramp(from.sag_time, to.sag_time);
+    dst.sag_coeff = ramp(from.sag_coeff, to.sag_coeff);
+
+    dst.output_level = ramp(from.output_level, to.output_level);
+  }
+
   PlugProcessor::PlugProcessor ()
   {
     setControllerClass (MyControllerUID);
@@ -88,9 +113,27 @@ namespace Vst {
     mCabinet = 1.0;
     mBypass = false;
 
+    loader.start();
+
     return kResultTrue;
   }
 
+  tresult PLUGIN_API PlugProcessor::terminate ()
+  {
+    pipeline.stop();
+
+    loader.release(profile);
+    loader.release(outgoing);
+    loader.release(pending);
+    profile = nullptr;
+    outgoing = nullptr;
+    pending = nullptr;
+
+    loader.stop();
+
+    return AudioEffect::terminate ();
+  }
+
   tresult PLUGIN_API PlugProcessor::setBusArrangements (Vst::SpeakerArrangement* inputs,
                                                         int32 numIns,
                                                         Vst::SpeakerArrangement* outputs,
@@ -106,8 +149,22 @@ namespace Vst {
   tresult PLUGIN_API PlugProcessor::setupProcessing (Vst::ProcessSetup& setup)
   {
     sampleRate = setup.sampleRate;
+    offline = (setup.processMode == kOffline);
+
+    maxBlockSize = std::max(setup.maxSamplesPerBlock, (int32)1);
+    irOptions.partition = selectedPartition();
+    irOptions.uniform = offline;
+
+    // Work buffers hold the largest host block,
+    // or one fragment of the largest partition
+    int32 maxFragment = std::max((int32)PARTITION_MAX, (int32)irOptions.partition);
+    bufsize = std::max(maxBlockSize, maxFragment);
     setBufsize(bufsize);
 
+    fifo.setup(irOptions.partition, maxFragment, 2, bufsize, fragmentLatency());
+    fifo.setPadding(offline);
+    fifoLatency = fifo.latency();
+
     dsp->init(sampleRate);
 
     dsp->ports.drive = mDrive * 100.0;
@@ -118,14 +175,8 @@ namespace Vst {
     dsp->ports.volume = mLevel;
     dsp->ports.cabinet = mCabinet;
 
-    if (profilePath != "")
-    {
-      if (check_profile_file(profilePath.c_str()))
-      {
-        profile = load_profile(profilePath.c_str());
-        dsp->profile = &profile->header;
-      }
-    }
+    updateLatency();
+
     return AudioEffect::setupProcessing (setup);
   }
 
@@ -133,22 +184,85 @@ namespace Vst {
   {
     if (state)
     {
-      if (profilePath != "")
+      fifo.reset();
+
+      // Loaded for the previous setup and not
+      // taken yet, it may not fit the buffers
+      loader.drop_stale(sampleRate, irOptions);
+
+      if (profile && (profile->path == profilePath) &&
+          (profile->ir->sample_rate == sampleRate) &&
+          (profile->ir->options == irOptions))
       {
-        if (check_profile_file(profilePath.c_str()))
+        // Layout is the same, only
+        // reset convolver state
+        loader.resume(profile);
+      }
+      else if (profilePath != "")
+      {
+        // Rebuild from the resident 48000 Hz IRs
+        // if the profile file is the same
+        std::shared_ptr<const TapfFile> master;
+        if (profile && (profile->path == profilePath))
         {
-          profile = load_profile(profilePath.c_str());
-          dsp->profile = &profile->header;
+          master = profile->master;
+        }
+
+        loader.release(profile);
+        profile = nullptr;
+
+        if (offline)
+        {
+          // Rendering starts right away,
+          // it must not begin dry
+          profile = loader.load_now(profilePath, sampleRate, irOptions, master);
+          if (profile)
+          {
+            dsp->profile = &profile->header;
+            tailSamples = profile->ir->preamp_size + profile->ir->cabinet_size;
+          }
+        }
+        else
+        {
+          loader.request(profilePath, sampleRate, irOptions, master);
         }
       }
+
+      // Started or stopped to match the setting,
+      // the host reactivates on its latency change
+      if (pipelineSetting)
+      {
+        pipeline.start(bufsize, pipelineLatency(), [this]() { cabinetJob(); });
+      }
+      else
+      {
+        pipeline.stop();
+      }
+      updateLatency();
     }
     else
     {
-      if (profile)
+      // Worker may still hold the profiles
+      pipeline.stop();
+
+      // Profile is kept for the next activation
+      loader.release(outgoing);
+      outgoing = nullptr;
+
+      // Nothing is playing, a waiting
+      // partition switch is done at once
+      if (pending)
       {
-        delete profile;
-        profile = nullptr;
+        loader.release(profile);
+        profile = pending;
+        pending = nullptr;
+        fifo.setFragment(profile->ir->partition);
+        dsp->profile = &profile->header;
+        tailSamples = profile->ir->preamp_size + profile->ir->cabinet_size;
       }
+      switchState = SWITCH_NONE;
+
+      loader.suspend(profile);
     }
     return AudioEffect::setActive (state);
   }
@@ -235,6 +349,45 @@ namespace Vst {
       }
     }
 
+    // Pick up a profile finished by the loader thread,
+    // the current one becomes outgoing and fades out.
+    // Next switch waits until the fade is over.
+    if (!outgoing && !pending)
+    {
+      stProfile *fresh = loader.acquire(sampleRate, fifo.maxFragment());
+      if (fresh)
+      {
+        crossfadeSamples = std::max((int32)(crossfadeTime * sampleRate / 1000.0), (int32)1);
+
+        if (profile && (profile->ir->partition != fresh->ir->partition))
+        {
+          // Convolvers with other partition sizes can not
+          // run on the same steps, switch while muted
+          pending = fresh;
+          switchState = SWITCH_OUT;
+          switchSample = 0;
+          switchLength = std::max(crossfadeSamples / 2, (int32)1);
+        }
+        else
+        {
+          outgoing = profile;
+          fadeSample = 0;
+          profile = fresh;
+          fifo.setFragment(profile->ir->partition);
+          dsp->profile = &profile->header;
+          tailSamples = profile->ir->preamp_size + profile->ir->cabinet_size;
+        }
+      }
+    }
+
+    if ((switchState == SWITCH_OUT) && (switchSample >= switchLength))
+    {
+      switchPartition();
+    }
+
+    checkLatency(data);
+    checkTail(data);
+
     if (data.numInputs == 0 || data.numOutputs == 0)
     {
       return kResultOk;
@@ -266,65 +419,69 @@ namespace Vst {
         outputs[1] = data.outputs[0].channelBuffers32[0];
       }
 
-      if (!mBypass)
-      {
-        for (int i = 0; i < data.numSamples; i++)
-        {
-          preamp_inp_buf[i] = (inputs[0][i] + inputs[1][i]) / 2.0;
-        }
-
-        int bufp = 0;
+      uint64 channelMask = ((uint64)1 << numChannels) - 1;
+      bool inputSilent = (data.inputs[0].silenceFlags & channelMask) == channelMask;
+      data.outputs[0].silenceFlags = 0;
 
-        while (bufp < data.numSamples)
-        {
-          memcpy(profile->preamp_convproc.inpdata(0),
-            preamp_inp_buf.data() + bufp,
-            fragm * sizeof(float));
-          profile->preamp_convproc.process(true);
-          memcpy(preamp_outp_buf.data() + bufp,
-            profile->preamp_convproc.outdata(0),
-            fragm * sizeof(float));
-          bufp += fragm;
-        }
-
-        for (int i = 0; i < data.numSamples; i++)
-        {
-          inputs[0][i] = preamp_outp_buf[i];
-          inputs[1][i] = preamp_outp_buf[i];
-        }
+      // Silent amp output must last through both
+      // convolver tails before the whole chain is silent
+      int32 silenceLength = profile->ir->preamp_size + profile->ir->cabinet_size +
+                            (pipeline.running() ? pipeline.latency() : 0) +
+                            sampleRate * SILENCE_HOLD;
 
-        dsp->compute(data.numSamples, inputs, outputs);
-        bufp = 0;
-
-        memcpy(drybuf_l.data(), outputs[0], data.numSamples * sizeof(float));
-        memcpy(drybuf_r.data(), outputs[1], data.numSamples * sizeof(float));
-
-        while (bufp < data.numSamples)
-        {
-          memcpy(profile->convproc.inpdata(0), outputs[0] + bufp, fragm * sizeof(float));
-          memcpy(profile->convproc.inpdata(1), outputs[1] + bufp, fragm * sizeof(float));
-
-          profile->convproc.process(true);
-          memcpy(outputs[0] + bufp, profile->convproc.outdata(0), fragm * sizeof(float));
-          memcpy(outputs[1] + bufp, profile->convproc.outdata(1), fragm * sizeof(float));
-
-          bufp += fragm;
-        }
+      if (outgoing)
+      {
+        silentSamples = 0;
+      }
 
-        for (int i = 0; i < data.numSamples; i++)
+      if (!mBypass && inputSilent && (silentSamples >= silenceLength))
+      {
+        // Nothing to compute until the input comes back
+        SilenceTracker::clear(data, numChannels);
+      }
+      else if (!mBypass)
+      {
+        chainInputSilent = inputSilent;
+        fifo.process(inputs, outputs, data.numSamples,
+                     [this](float **in, float **out, int count)
+                     {
+                       processChain(in, out, count);
+                     });
+
+        if (silentSamples >= silenceLength)
         {
-          outputs[0][i] = outputs[0][i] * (dsp->ports.cabinet) + drybuf_l[i] * (1.0 - dsp->ports.cabinet);
-          outputs[1][i] = outputs[1][i] * (dsp->ports.cabinet) + drybuf_r[i] * (1.0 - dsp->ports.cabinet);
+          // Remaining output is below SILENCE_THRESHOLD,
+          // amp state is kept, see SilenceTracker
+          SilenceTracker::clear(data, numChannels);
         }
       }
       else
       {
-        for (int i = 0; i < data.numSamples; i++)
-        {
-          outputs[0][i] = inputs[0][i];
-          outputs[1][i] = inputs[1][i];
-        }
+        // Dry signal goes through the FIFO and the
+        // pipeline too, so bypass keeps the reported latency
+        fifo.process(inputs, outputs, data.numSamples,
+                     [this](float **in, float **out, int count)
+                     {
+                       if (pipeline.running())
+                       {
+                         pipelineWait();
+                         pipeline.push();
+                         pipeline.push(in[0], in[1], count);
+                         pipeline.pull(out[0], out[1], count);
+                         return;
+                       }
+
+                       for (int i = 0; i < count; i++)
+                       {
+                         out[0][i] = in[0][i];
+                         out[1][i] = in[1][i];
+                       }
+                     });
+        data.outputs[0].silenceFlags = data.inputs[0].silenceFlags & channelMask;
       }
+
+      checkLatency(data);
+      checkTail(data);
     }
     else
     {
@@ -332,8 +489,42 @@ namespace Vst {
       {
         memset(data.outputs[0].channelBuffers32[i], 0, data.numSamples * sizeof(float));
       }
+      data.outputs[0].silenceFlags = ((uint64)1 << numChannels) - 1;
     }
 
+    if (switchState != SWITCH_NONE)
+    {
+      switchGain(data, numChannels);
+    }
+
+    // Outgoing profile is done after crossfadeSamples,
+    // retry next block if the loader is still busy
+    if (outgoing && (fadeSample >= crossfadeSamples))
+    {
+      // Last part of the crossfade may still be
+      // on the pipeline worker
+      pipelineWait();
+
+      // Time spent on the outgoing profile, relative
+      // to the crossfade duration, 1 is a whole core
+      double load = outgoing->fade_time_ns / (crossfadeSamples / sampleRate * 1e9);
+
+      if (loader.retire(outgoing))
+      {
+        outgoing = nullptr;
+
+        if (data.outputParameterChanges)
+        {
+          int32 index = 0;
+          IParamValueQueue *queue =
+            data.outputParameterChanges->addParameterData (kCrossfadeLoadId, index);
+          if (queue)
+          {
+            queue->addPoint (0, std::min(load, 1.0), index);
+          }
+        }
+      }
+    }
 
     return kResultOk;
   }
@@ -379,6 +570,32 @@ namespace Vst {
 
     profilePath = streamer.readStr8();
 
+    // Missing in states saved before Min Phase
+    int32 savedMinPhase = 0;
+    if (streamer.readInt32(savedMinPhase) == false)
+      savedMinPhase = 0;
+    irOptions.min_phase = savedMinPhase > 0;
+
+    // Missing in states saved before Partition,
+    // 0 is automatic
+    int32 savedPartition = 0;
+    if (streamer.readInt32(savedPartition) == false)
+      savedPartition = 0;
+    partitionSetting = (savedPartition > 0) ? valid_partition(savedPartition) : 0;
+    irOptions.partition = selectedPartition();
+
+    // Missing in states saved before Pipeline
+    int32 savedPipeline = 0;
+    if (streamer.readInt32(savedPipeline) == false)
+      savedPipeline = 0;
+    pipelineSetting = savedPipeline > 0;
+
+    // Missing in states saved before Crossfade
+    int32 savedCrossfade = PROFILE_CROSSFADE_TIME;
+    if (streamer.readInt32(savedCrossfade) == false)
+      savedCrossfade = PROFILE_CROSSFADE_TIME;
+    crossfadeTime = std::max(savedCrossfade, (int32)1);
+
     mDrive = savedDrive;
     mBass = savedBass;
     mMiddle = savedMiddle;
@@ -420,14 +637,11 @@ namespace Vst {
     streamer.writeFloat (toSaveCabinet);
     streamer.writeInt32 (toSaveBypass);
 
-    if (profile)
-    {
-      streamer.writeStr8(profile->path.c_str());
-    }
-    else
-    {
-      streamer.writeStr8("");
-    }
+    streamer.writeStr8(profilePath.c_str());
+    streamer.writeInt32(irOptions.min_phase ? 1 : 0);
+    streamer.writeInt32(partitionSetting);
+    streamer.writeInt32(pipelineSetting ? 1 : 0);
+    streamer.writeInt32(crossfadeTime);
 
     return kResultOk;
   }
@@ -436,222 +650,681 @@ namespace Vst {
   {
     if (text)
     {
-      if (check_profile_file(text))
+      if (ProfileLoader::check_profile_file(text))
       {
-        stProfile *oldProfile = profile;
-        profile = load_profile(text);
         profilePath = text;
-        dsp->profile = &profile->header;
-        if (oldProfile)
-        {
-          delete oldProfile;
-        }
+        loader.request(profilePath, sampleRate, irOptions);
       }
     }
     return kResultOk;
   }
 
-  bool PlugProcessor::check_profile_file(const char *path)
+  tresult PLUGIN_API PlugProcessor::notify (IMessage* message)
   {
-    bool status = false;
-
-    FILE * profile_file = fopen(path, "rb");
+    if (message && !strcmp (message->getMessageID (), "MinPhase"))
+    {
+      int64 value = 0;
+      if (message->getAttributes ()->getInt ("value", value) == kResultOk)
+      {
+        bool minPhase = value != 0;
+        if (minPhase != irOptions.min_phase)
+        {
+          irOptions.min_phase = minPhase;
+          if (profilePath != "")
+          {
+            loader.request(profilePath, sampleRate, irOptions);
+          }
+        }
+      }
+      return kResultOk;
+    }
 
-    if (profile_file != NULL)
+    if (message && !strcmp (message->getMessageID (), "Partition"))
     {
-      st_profile_header check_profile;
-      if (fread(&check_profile, sizeof(st_profile_header), 1, profile_file) == 1)
+      int64 value = 0;
+      if (message->getAttributes ()->getInt ("value", value) == kResultOk)
       {
-        if (!strncmp(check_profile.signature, "TaPf", 4))
+        partitionSetting = (value > 0) ? valid_partition(value) : 0;
+        uint32_t partition = selectedPartition();
+        if (partition != irOptions.partition)
         {
-          status = true;
+          irOptions.partition = partition;
+          if (profilePath != "")
+          {
+            loader.request(profilePath, sampleRate, irOptions);
+          }
+          updateLatency();
         }
       }
-      else status = false;
+      return kResultOk;
+    }
+
+    if (message && !strcmp (message->getMessageID (), "Pipeline"))
+    {
+      int64 value = 0;
+      if (message->getAttributes ()->getInt ("value", value) == kResultOk)
+      {
+        // Latency is reported for the new setting
+        // right away, the worker starts or stops
+        // when the host reactivates on the change
+        pipelineSetting = value != 0;
+        updateLatency();
+      }
+      return kResultOk;
+    }
+
+    if (message && !strcmp (message->getMessageID (), "Crossfade"))
+    {
+      int64 value = 0;
+      if (message->getAttributes ()->getInt ("value", value) == kResultOk)
+      {
+        // Running crossfade keeps its length
+        crossfadeTime = std::max((int32)value, (int32)1);
+      }
+      return kResultOk;
+    }
+
+    return AudioEffect::notify (message);
+  }
+
+  uint32 PLUGIN_API PlugProcessor::getLatencySamples ()
+  {
+    return latencySamples;
+  }
+
+  uint32 PLUGIN_API PlugProcessor::getTailSamples ()
+  {
+    // Impulse responses of both convolvers,
+    // the amp model itself has no long tail.
+    // Output is delayed by the latency on top.
+    return tailSamples + latencySamples;
+  }
+
+  // Partition size from the Partition setting,
+  // 'Auto' takes the largest one up to
+  // PARTITION_MAX that fits the host block.
+  // Once a shorter block has made the FIFO
+  // latency grow it falls back to the default.
+  uint32_t PlugProcessor::selectedPartition()
+  {
+    if (offline)
+    {
+      // Fewest steps per block, the host compensates
+      // the FIFO latency if blocks do not fit
+      uint32_t partition = PARTITION_OFFLINE_MAX;
+      while ((partition > PARTITION_OFFLINE_MIN) && (maxBlockSize % partition != 0))
+      {
+        partition >>= 1;
+      }
+
+      return (maxBlockSize % partition == 0) ? partition : PARTITION_MAX;
+    }
+
+    if (partitionSetting > 0)
+    {
+      return partitionSetting;
+    }
+
+    // Host blocks of other sizes need the FIFO
+    // anyway, its latency is the partition size
+    if (fifo.latencyGrown())
+    {
+      return fragm;
+    }
+
+    uint32_t partition = PARTITION_MAX;
+    while ((partition > PARTITION_MIN) && (maxBlockSize % partition != 0))
+    {
+      partition >>= 1;
+    }
+
+    return (maxBlockSize % partition == 0) ? partition : fragm;
+  }
+
+  // Delay between input and output added by
+  // the current processing mode, in samples.
+  // Convolvers run synchronously, the fragment
+  // FIFO and the cabinet pipeline may add a delay.
+  uint32 PlugProcessor::processingLatency()
+  {
+    return fragmentLatency() + pipelineLatency();
+  }
+
+  // Delay of the fragment FIFO alone, 0 or
+  // the partition size
+  uint32 PlugProcessor::fragmentLatency()
+  {
+    // Zero latency needs blocks of whole fragments,
+    // keep the delay once the host has sent other sizes
+    bool aligned = (maxBlockSize % irOptions.partition == 0) &&
+                   !fifo.latencyGrown();
+
+    return aligned ? 0 : irOptions.partition;
+  }
+
+  // Delay of the cabinet pipeline for the Pipeline
+  // setting, the longest chain call. The running worker
+  // keeps the delay it was started with until the next
+  // activation, a longer call after a partition change
+  // waits for its own job.
+  uint32 PlugProcessor::pipelineLatency()
+  {
+    if (!pipelineSetting)
+    {
+      return 0;
+    }
+
+    return std::max(maxBlockSize, (int32)irOptions.partition);
+  }
+
+  // Message thread: the controller asks the host
+  // to query getLatencySamples() again
+  void PlugProcessor::updateLatency()
+  {
+    uint32 latency = processingLatency();
+    if (latency == latencySamples)
+    {
+      return;
+    }
+
+    latencySamples = latency;
+
+    if (IPtr<IMessage> message = owned (allocateMessage ()))
+    {
+      message->setMessageID ("Latency");
+      message->getAttributes ()->setInt ("value", latency);
+      sendMessage (message);
+    }
+  }
+
+  // Audio thread: reports a FIFO delay changed by
+  // a partition switch or an unaligned host block.
+  // The controller restarts the component when the
+  // latency output parameter changes.
+  void PlugProcessor::checkLatency(ProcessData &data)
+  {
+    if (fifo.latency() == fifoLatency)
+    {
+      return;
+    }
+
+    fifoLatency = fifo.latency();
+
+    uint32 latency = fifoLatency + pipelineLatency();
+    if (latency == latencySamples)
+    {
+      return;
+    }
+
+    latencySamples = latency;
+
+    if (data.outputParameterChanges)
+    {
+      int32 index = 0;
+      IParamValueQueue *queue =
+        data.outputParameterChanges->addParameterData (kLatencyId, index);
+      if (queue)
+      {
+        queue->addPoint (0, (ParamValue)latency / kLatencyRange, index);
+      }
+    }
+  }
 
-      fclose(profile_file);
+  // Audio thread: reports a tail changed by a profile
+  // or latency change through the tail output parameter.
+  // The controller restarts the component, so the
+  // host calls getTailSamples() again.
+  void PlugProcessor::checkTail(ProcessData &data)
+  {
+    uint32 tail = getTailSamples();
+    if (tail == tailReported)
+    {
+      return;
     }
 
-    return status;
+    if (data.outputParameterChanges)
+    {
+      int32 index = 0;
+      IParamValueQueue *queue =
+        data.outputParameterChanges->addParameterData (kTailId, index);
+      if (queue)
+      {
+        double value = std::min((double)tail / kTailRange, 1.0);
+        queue->addPoint (0, (ParamValue)value, index);
+        tailReported = tail;
+      }
+    }
   }
 
-  // Function loads profile from file at 'path'
-  // and creates new convolvers
-  // with IR data from that *.tapf file
-  stProfile* PlugProcessor::load_profile(const char *path)
+  // Amp and cabinet chain, 'count' is a multiple of the
+  // partition size and not more than bufsize. Runs the outgoing
+  // profile alongside while a crossfade is in progress.
+  //
+  // Each stage runs over the whole call, 'in' is read
+  // into the preamp buffer first, so 'in' and 'out' may
+  // be the same buffers. In pipeline mode the amp output
+  // goes to the pipeline and the cabinet stage runs on
+  // its worker instead.
+  void PlugProcessor::processChain(float **in, float **out, int count)
   {
+    stProfile *fading = (fadeSample < crossfadeSamples) ? outgoing : nullptr;
+
+    stCabinetJob job;
+    job.profile = profile;
+    job.fading = fading;
+    job.cabinet = dsp->ports.cabinet;
+    job.fadeStart = fadeSample;
+    job.fadeLength = crossfadeSamples;
+    job.count = count;
+    job.rampStep = 1.0 / (sampleRate * CABINET_RAMP_TIME);
+
+    if (fading)
+    {
+      fadeGains(fade_in_gain.data(), fade_out_gain.data(), fadeSample, crossfadeSamples, count);
+      fadeSample += count;
+    }
 
-    FILE *profile_file = fopen(path, "rb");
-    if (profile_file != NULL)
+    bool pipelined = pipeline.running();
+    if (!pipelined)
     {
-      stProfile *p_profile = new stProfile();
+      cabinetState(job);
+    }
+
+    int partition = profile->ir->partition;
+
+    for (int i = 0; i < count; i++)
+    {
+      preamp_inp_buf[i] = (in[0][i] + in[1][i]) / 2.0;
+    }
+
+    convolve(&profile->preamp_convproc, partition,
+             preamp_inp_buf.data(), preamp_outp_buf.data(), count);
 
-      if (fread(&p_profile->header, sizeof(st_profile_header), 1, profile_file) == 1)
+    if (fading)
+    {
+      std::chrono::steady_clock::time_point fadeStart = std::chrono::steady_clock::now();
+
+      convolve(&fading->preamp_convproc, partition,
+               preamp_inp_buf.data(), fadebuf.data(), count);
+
+      fading->fade_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - fadeStart).count();
+    }
+
+    // Amp is mono, the cabinet stage
+    // fans its output out to stereo
+    float *amp_out = pipelined ? pipeline.amp() : drybuf.data();
+    int tileSize = (chainTile > 0) ? (int)chainTile : count;
+    bool ampSilent = chainInputSilent;
+
+    dsp->profile = fading ? &fadeHeader : &profile->header;
+
+    // Crossfade and amp run tile by tile,
+    // each tile passes both while in L1 cache
+    for (int tile = 0; tile < count; tile += tileSize)
+    {
+      int n = std::min(tileSize, count - tile);
+      float *tile_in = preamp_outp_buf.data() + tile;
+      float *tile_out = amp_out + tile;
+
+      if (fading)
       {
+        crossfade(tile_in, fadebuf.data() + tile, n, tile);
+        mix_header(fadeHeader, fading->header, profile->header,
+                   (float)(job.fadeStart + tile + n) / job.fadeLength);
+      }
+
+      dsp->compute(n, &tile_in, &tile_out);
 
-        // IRs in *.tapf are 48000 Hz,
-        // calculate ratio for resampling
-        float ratio = (float)sampleRate / 48000.0;
+      for (int i = 0; (i < n) && ampSilent; i++)
+      {
+        ampSilent = fabs(tile_out[i]) < SILENCE_THRESHOLD;
+      }
+    }
 
-        st_impulse_header preamp_impheader, impheader;
+    if (ampSilent)
+    {
+      silentSamples += count;
+    }
+    else
+    {
+      silentSamples = 0;
+    }
 
-        // Load preamp IR data to temp buffer
-        if (fread(&preamp_impheader, sizeof(st_impulse_header), 1, profile_file) != 1)
-        {
-          return NULL;
-        }
-        std::vector<float> preamp_impulse(preamp_impheader.sample_count);
-        if (fread(preamp_impulse.data(), sizeof(float),
-          preamp_impheader.sample_count,
-          profile_file) != (size_t)preamp_impheader.sample_count)
+    if (!pipelined)
+    {
+      for (int pos = 0; pos < count; pos += partition)
+      {
+        int64_t fadeTime = cabinetStep(job, amp_out + pos, out[0] + pos, out[1] + pos, partition,
+                                       fade_in_gain.data() + pos, fade_out_gain.data() + pos);
+        if (fading)
         {
-          return NULL;
+          fading->fade_time_ns += fadeTime;
         }
+      }
+      return;
+    }
 
-        std::vector<float> left_impulse;
-        std::vector<float> right_impulse;
-        // Load cabsym IR data to temp buffers
-        for (int i=0;i<2;i++)
-        {
-          if (fread(&impheader, sizeof(st_impulse_header), 1, profile_file) != 1)
-          {
-            return NULL;
-          }
+    // Previous chain call has left the worker,
+    // cabinet states may change now
+    pipelineWait();
+    pipeline.push();
 
-          if (impheader.channel==0)
-          {
-            left_impulse.resize(impheader.sample_count);
-            if (fread(left_impulse.data(), sizeof(float),
-              impheader.sample_count, profile_file) != (size_t)impheader.sample_count)
-            {
-              return NULL;
-            }
-          }
-          if (impheader.channel==1)
-          {
-            right_impulse.resize(impheader.sample_count);
-            if (fread(right_impulse.data(), sizeof(float),
-              impheader.sample_count, profile_file) != (size_t)impheader.sample_count)
-            {
-              return NULL;
-            }
-          }
-        }
+    cabinetState(job);
+    pipeline.job = job;
+    pipeline.post();
 
-        // If current rate is not 48000 Hz do resampling
-        // with Zita-resampler
-        if (sampleRate!=48000)
-        {
-          {
-            Resampler resampl;
-            resampl.setup(48000,sampleRate,1,48);
+    // Longer than the pipeline delay after a partition
+    // change, wait for this call right away
+    if (count > pipeline.latency())
+    {
+      pipelineWait();
+      pipeline.push();
+    }
 
-            int k = resampl.inpsize();
+    pipeline.pull(out[0], out[1], count);
+  }
 
-            std::vector<float> preamp_in(preamp_impheader.sample_count + k/2 - 1 + k - 1);
-            std::vector<float> preamp_out((unsigned int)((preamp_impheader.sample_count + k/2 - 1 + k - 1)*ratio));
+  // Runs 'count' samples of mono 'in' through
+  // 'convproc' in 'partition' sized steps
+  void PlugProcessor::convolve(Convproc *convproc, int partition,
+                               const float *in, float *out, int count)
+  {
+    for (int pos = 0; pos < count; pos += partition)
+    {
+      memcpy(convproc->inpdata(0), in + pos, partition * sizeof(float));
+      convproc->process(THREAD_SYNC_MODE);
+      memcpy(out + pos, convproc->outdata(0), partition * sizeof(float));
+    }
+  }
 
-            // Create paddig before and after signal, needed for zita-resampler
-            for (int i = 0; i < preamp_impheader.sample_count + k/2 - 1 + k - 1; i++)
-            {
-              preamp_in[i] = 0.0;
-            }
+  // Sets which cabinet convolvers of 'job' run,
+  // they are stopped while the knob is at zero
+  void PlugProcessor::cabinetState(stCabinetJob &job)
+  {
+    if (job.cabinet <= 0.0)
+    {
+      // Cabinet is off, its convolvers are stopped and
+      // flushed, so turning it back on starts clean
+      stop_cabinet(job.profile);
+      stop_cabinet(job.fading);
+      job.wet = false;
+      job.fadingWet = false;
+    }
+    else
+    {
+      // Flush not finished yet, stay dry
+      job.wet = cabinet_ready(job.profile);
+      job.fadingWet = job.fading && cabinet_ready(job.fading);
+    }
+  }
 
-            for (int i = k/2 - 1; i < preamp_impheader.sample_count + k/2 - 1; i++)
-            {
-              preamp_in[i] = preamp_impulse[i - k/2 + 1];
-            }
+  // Cabinet stage of one partition of amp output 'amp':
+  // cabinet convolution, crossfade with the outgoing profile
+  // and the Cabinet mix into 'out_l' and 'out_r'. Returns time
+  // spent on the outgoing profile, in nanoseconds.
+  int64_t PlugProcessor::cabinetStep(const stCabinetJob &job, const float *amp,
+                                     float *out_l, float *out_r, int count,
+                                     const float *fade_in, const float *fade_out)
+  {
+    if (job.cabinet <= 0.0)
+    {
+      memcpy(out_l, amp, count * sizeof(float));
+      if (out_r != out_l)
+      {
+        memcpy(out_r, amp, count * sizeof(float));
+      }
+      return 0;
+    }
 
-            resampl.inp_count = preamp_impheader.sample_count + k/2 - 1 + k - 1;
-            resampl.out_count = (unsigned int)((preamp_impheader.sample_count + k/2 - 1 + k - 1)*ratio);
-            resampl.inp_data = preamp_in.data();
-            resampl.out_data = preamp_out.data();
+    int64_t fadeTime = 0;
+    stProfile *fading = job.fading;
 
-            resampl.process();
+    // Dry amp output is the input of both cabinets,
+    // one output convolvers feed both channels
+    const float *fading_out[2] = {amp, amp};
+    if (fading)
+    {
+      std::chrono::steady_clock::time_point fadeStart = std::chrono::steady_clock::now();
 
-            preamp_impulse.resize(preamp_impheader.sample_count * ratio);
-            for (unsigned int i = 0; i < (unsigned int)(preamp_impheader.sample_count*ratio); i++)
-            {
-              preamp_impulse[i] = preamp_out[i] / ratio;
-            }
-          }
+      if (job.fadingWet)
+      {
+        memcpy(fading->convproc.inpdata(0), amp, count * sizeof(float));
+        fading->convproc.process(THREAD_SYNC_MODE);
+        fading_out[0] = fading->convproc.outdata(0);
+        fading_out[1] = fading->convproc.outdata(fading->ir->cabinet_outputs - 1);
+      }
 
-          {
-            Resampler resampl;
-            resampl.setup(48000,sampleRate,2,48);
+      fadeTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - fadeStart).count();
+    }
 
-            int k = resampl.inpsize();
+    // Cabinet output ramps in from the dry
+    // signal it was replaced with while flushing
+    float ramp = job.wet ? job.profile->cabinet_ramp : 1.0f;
+    float fadingRamp = job.fadingWet ? fading->cabinet_ramp : 1.0f;
 
-            std::vector<float> inp_data((impheader.sample_count + k/2 - 1 + k - 1)*2);
+    const float *wet_out[2] = {amp, amp};
+    if (job.wet)
+    {
+      memcpy(job.profile->convproc.inpdata(0), amp, count * sizeof(float));
+      job.profile->convproc.process(THREAD_SYNC_MODE);
+      wet_out[0] = job.profile->convproc.outdata(0);
+      wet_out[1] = job.profile->convproc.outdata(job.profile->ir->cabinet_outputs - 1);
+    }
 
-            // Create paddig before and after signal, needed for zita-resampler
-            for (int i = 0; i < impheader.sample_count + k/2 - 1 + k - 1; i++)
-            {
-              inp_data[i*2] = 0.0;
-              inp_data[i*2+1] = 0.0;
-            }
+    float cabinet = job.cabinet;
+    for (int i = 0; i < count; i++)
+    {
+      float dry = amp[i];
+      float left = wet_out[0][i];
+      float right = wet_out[1][i];
 
-            for (int i = k/2 - 1; i < impheader.sample_count + k/2 - 1; i++)
-            {
-              inp_data[i*2] = left_impulse[i-k/2+1];
-              inp_data[i*2+1] = right_impulse[i-k/2+1];
-            }
+      if (ramp < 1.0f)
+      {
+        left = left * ramp + dry * (1.0f - ramp);
+        right = right * ramp + dry * (1.0f - ramp);
+        ramp = std::min(ramp + job.rampStep, 1.0f);
+      }
 
-            std::vector<float> out_data((unsigned int)((impheader.sample_count + k/2 - 1 + k - 1)*ratio*2));
+      if (fading)
+      {
+        float fading_left = fading_out[0][i];
+        float fading_right = fading_out[1][i];
 
-            resampl.inp_count = impheader.sample_count + k/2 - 1 + k - 1;
-            resampl.out_count = (unsigned int)((impheader.sample_count + k/2 - 1 + k - 1)*ratio);
-            resampl.inp_data = inp_data.data();
-            resampl.out_data = out_data.data();
+        if (fadingRamp < 1.0f)
+        {
+          fading_left = fading_left * fadingRamp + dry * (1.0f - fadingRamp);
+          fading_right = fading_right * fadingRamp + dry * (1.0f - fadingRamp);
+          fadingRamp = std::min(fadingRamp + job.rampStep, 1.0f);
+        }
 
-            resampl.process();
+        left = left * fade_in[i] + fading_left * fade_out[i];
+        right = right * fade_in[i] + fading_right * fade_out[i];
+      }
 
-            left_impulse.resize((unsigned int)(impheader.sample_count * ratio));
-            right_impulse.resize((unsigned int)(impheader.sample_count * ratio));
+      if (cabinet < 1.0)
+      {
+        left = left * cabinet + dry * (1.0 - cabinet);
+        right = right * cabinet + dry * (1.0 - cabinet);
+      }
 
-            for (unsigned int i = 0; i < (unsigned int)(impheader.sample_count*ratio); i++)
-            {
-              left_impulse[i] = out_data[i*2] / ratio;
-              right_impulse[i] = out_data[i*2+1] / ratio;
-            }
-          }
+      out_l[i] = left;
+      out_r[i] = right;
+    }
 
-        }
+    if (job.wet)
+    {
+      job.profile->cabinet_ramp = ramp;
+    }
+    if (job.fadingWet)
+    {
+      fading->cabinet_ramp = fadingRamp;
+    }
+
+    return fadeTime;
+  }
+
+  // Pipeline worker: cabinet stage of the posted job
+  void PlugProcessor::cabinetJob()
+  {
+    stCabinetJob &job = pipeline.job;
+    const float *amp = pipeline.jobAmp();
+    float *fade_in = pipeline.fade_in.data();
+    float *fade_out = pipeline.fade_out.data();
+
+    if (job.fading)
+    {
+      fadeGains(fade_in, fade_out, job.fadeStart, job.fadeLength, job.count);
+    }
+
+    job.fade_time_ns = 0;
+    int partition = job.profile->ir->partition;
+    for (int pos = 0; pos < job.count; pos += partition)
+    {
+      job.fade_time_ns += cabinetStep(job, amp + pos,
+                                      pipeline.out_l.data() + pos, pipeline.out_r.data() + pos,
+                                      partition, fade_in + pos, fade_out + pos);
+    }
+  }
 
-        // Create preamp convolver
-        Convproc *p_preamp_convproc = &p_profile->preamp_convproc;
-        p_preamp_convproc->configure (1, 1, (unsigned int)(preamp_impheader.sample_count*ratio),
-                                      fragm, fragm, Convproc::MAXPART, 0.0);
-        p_preamp_convproc->impdata_create (0, 0, 1, preamp_impulse.data(),
-                                           0, (unsigned int)(preamp_impheader.sample_count*ratio));
+  // Audio thread: waits for the posted job, so its
+  // profiles may be retired or their cabinets stopped
+  void PlugProcessor::pipelineWait()
+  {
+    pipeline.wait();
 
-        p_preamp_convproc->start_process(CONVPROC_SCHEDULER_PRIORITY,
-                                         CONVPROC_SCHEDULER_CLASS);
+    stCabinetJob &job = pipeline.job;
+    if (job.fading)
+    {
+      job.fading->fade_time_ns += job.fade_time_ns;
+      job.fading = nullptr;
+    }
+  }
 
-        // Create cabsym convolver
-        Convproc *p_convproc = &p_profile->convproc;
-        p_convproc->configure (2, 2, 48000/2, fragm, fragm, Convproc::MAXPART, 0.0);
+  // Equal-power crossfade gains for 'count' samples
+  // from position 'start' of a crossfade of 'length'
+  void PlugProcessor::fadeGains(float *fade_in, float *fade_out, int32 start, int32 length,
+                                int count)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      float phase = (float)(start + i + 1) / length;
+      phase = std::min(phase, 1.0f) * M_PI / 2.0;
+      fade_in[i] = sin(phase);
+      fade_out[i] = cos(phase);
+    }
+  }
 
-        p_convproc->impdata_create (0, 0, 1, left_impulse.data(), 0, 48000/2);
-        p_convproc->impdata_create (1, 1, 1, right_impulse.data(), 0, 48000/2);
+  // Stops a running cabinet convolver while the Cabinet
+  // knob is at zero, its output ramps in again after
+  // the loader thread has flushed it
+  void PlugProcessor::stop_cabinet(stProfile *cabinet)
+  {
+    if (cabinet && (cabinet->cabinet_state.load(std::memory_order_acquire) == CABINET_RUNNING))
+    {
+      cabinet->cabinet_ramp = 0.0;
+      loader.flush_cabinet(cabinet);
+    }
+  }
 
-        p_convproc->start_process (CONVPROC_SCHEDULER_PRIORITY, CONVPROC_SCHEDULER_CLASS);
+  // Returns false while the cabinet convolver
+  // of 'cabinet' is stopped and not flushed yet
+  bool PlugProcessor::cabinet_ready(stProfile *cabinet)
+  {
+    int state = cabinet->cabinet_state.load(std::memory_order_acquire);
+    if (state == CABINET_STOPPED)
+    {
+      return false;
+    }
+    if (state == CABINET_FLUSHED)
+    {
+      cabinet->cabinet_state.store(CABINET_RUNNING, std::memory_order_relaxed);
+    }
+    return true;
+  }
 
-        fclose(profile_file);
 
-        p_profile->path = path;
-        return p_profile;
+  // Mixes the outgoing profile signal 'fading' into 'dst'
+  // with the crossfade gains from 'offset' on
+  void PlugProcessor::crossfade(float *dst, const float *fading, int count, int offset)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      dst[i] = dst[i] * fade_in_gain[offset + i] + fading[i] * fade_out_gain[offset + i];
+    }
+  }
+
+  // Output is muted, the pending profile replaces the
+  // current one, which is retired without a crossfade.
+  // Output of the old one still in the FIFO and the
+  // pipeline is held muted.
+  void PlugProcessor::switchPartition()
+  {
+    outgoing = profile;
+    fadeSample = crossfadeSamples;
+    profile = pending;
+    pending = nullptr;
+
+    fifo.setFragment(profile->ir->partition);
+    dsp->profile = &profile->header;
+    tailSamples = profile->ir->preamp_size + profile->ir->cabinet_size;
+
+    switchState = SWITCH_HOLD;
+    switchSample = 0;
+    switchLength = fifo.latency() + (pipeline.running() ? pipeline.latency() : 0);
+  }
+
+  // Gain of the output around a partition switch:
+  // fades out, stays muted until the switch and the
+  // delayed output of the old profile are over,
+  // then fades in
+  void PlugProcessor::switchGain(ProcessData &data, int32 numChannels)
+  {
+    for (int32 i = 0; i < data.numSamples; i++)
+    {
+      float gain = 1.0;
+      if (switchState == SWITCH_OUT)
+      {
+        float phase = std::min((float)switchSample / switchLength, 1.0f);
+        gain = 0.5 + 0.5 * cos(phase * M_PI);
+        switchSample++;
+      }
+      else if (switchState == SWITCH_HOLD)
+      {
+        gain = 0.0;
+        if (++switchSample >= switchLength)
+        {
+          switchState = SWITCH_IN;
+          switchSample = 0;
+          switchLength = std::max(crossfadeSamples / 2, (int32)1);
+        }
+      }
+      else if (switchState == SWITCH_IN)
+      {
+        float phase = (float)switchSample / switchLength;
+        gain = 0.5 - 0.5 * cos(phase * M_PI);
+        if (++switchSample >= switchLength)
+        {
+          switchState = SWITCH_NONE;
+        }
+      }
+
+      for (int32 c = 0; c < numChannels; c++)
+      {
+        data.outputs[0].channelBuffers32[c][i] *= gain;
       }
     }
-    return nullptr;
   }
 
   void PlugProcessor::setBufsize(int size)
   {
-    drybuf_l.resize(size);
-    drybuf_r.resize(size);
     preamp_inp_buf.resize(size);
     preamp_outp_buf.resize(size);
+    drybuf.resize(size);
+    fadebuf.resize(size);
+    fade_in_gain.resize(size);
+    fade_out_gain.resize(size);
   }
 
 } // Vst
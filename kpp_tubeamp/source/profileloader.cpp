@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#include "../include/profileloader.h"
+#include "../include/tapffile.h"
+
+#include <algorithm>
+#include <chrono>
+
+ProfileLoader::~ProfileLoader()
+{
+  stop();
+}
+
+void ProfileLoader::start()
+{
+  if (thread.joinable())
+  {
+    return;
+  }
+
+  // No effect once another instance has
+  // started the pool, settings are the same
+  Convpool::configure(CONVPROC_POOL_THREADS, CONVPROC_POOL_AFFINITY);
+
+  quit = false;
+  thread = std::thread(&ProfileLoader::run, this);
+}
+
+void ProfileLoader::stop()
+{
+  if (thread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    cond.notify_one();
+    thread.join();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  reclaim();
+
+  stProfile *stale = ready.exchange(nullptr);
+  if (stale)
+  {
+    unpublish(stale);
+    delete stale;
+  }
+}
+
+void ProfileLoader::request(const std::string &path, float sampleRate,
+                            const stIrOptions &options,
+                            std::shared_ptr<const TapfFile> master)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    requestPath = path;
+    requestRate = sampleRate;
+    requestOptions = options;
+    requestMaster = master;
+    requested = true;
+    generation++;
+  }
+  cond.notify_one();
+}
+
+stProfile* ProfileLoader::load_now(const std::string &path, float sampleRate,
+                                   const stIrOptions &options,
+                                   std::shared_ptr<const TapfFile> master)
+{
+  stProfile *stale = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    requested = false;
+    requestMaster = nullptr;
+    generation++;
+
+    stale = ready.exchange(nullptr, std::memory_order_acq_rel);
+    if (stale)
+    {
+      unpublish(stale);
+    }
+  }
+  delete stale;
+
+  stProfile *fresh = load_profile(path.c_str(), sampleRate, options, master);
+
+  if (fresh)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    published.push_back(fresh);
+  }
+
+  return fresh;
+}
+
+stProfile* ProfileLoader::acquire(float sampleRate, uint32_t maxPartition)
+{
+  stProfile *fresh = ready.load(std::memory_order_acquire);
+  if (!fresh || (fresh->ir->sample_rate != sampleRate) ||
+      (fresh->ir->partition > maxPartition))
+  {
+    return nullptr;
+  }
+
+  // Loader may have replaced it meanwhile
+  if (!ready.compare_exchange_strong(fresh, nullptr, std::memory_order_acq_rel))
+  {
+    return nullptr;
+  }
+  return fresh;
+}
+
+void ProfileLoader::drop_stale(float sampleRate, const stIrOptions &options)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  stProfile *stale = ready.load(std::memory_order_acquire);
+  if (stale && ((stale->ir->sample_rate != sampleRate) ||
+                !(stale->ir->options == options)))
+  {
+    if (ready.compare_exchange_strong(stale, nullptr, std::memory_order_acq_rel))
+    {
+      unpublish(stale);
+      delete stale;
+    }
+  }
+}
+
+bool ProfileLoader::retire(stProfile *old)
+{
+  stProfile *expected = nullptr;
+  return retired.compare_exchange_strong(expected, old, std::memory_order_acq_rel);
+}
+
+void ProfileLoader::flush_cabinet(stProfile *profile)
+{
+  // Audio thread no longer runs the convolver,
+  // its last cycle is published with the state
+  profile->cabinet_state.store(CABINET_STOPPED, std::memory_order_release);
+}
+
+void ProfileLoader::release(stProfile *old)
+{
+  if (old)
+  {
+    // Under the mutex, so a flush of
+    // this profile is not running
+    std::lock_guard<std::mutex> lock(mutex);
+    unpublish(old);
+    delete old;
+  }
+}
+
+// Called with the mutex held
+void ProfileLoader::reclaim()
+{
+  stProfile *old = retired.exchange(nullptr, std::memory_order_acq_rel);
+  if (old)
+  {
+    unpublish(old);
+    delete old;
+  }
+}
+
+// Called with the mutex held: restarts cabinet
+// convolvers stopped by the audio thread. Each
+// profile has its own request, any number of
+// them may be pending.
+void ProfileLoader::flush_cabinets()
+{
+  for (stProfile *profile : published)
+  {
+    if (!profile->suspended &&
+        (profile->cabinet_state.load(std::memory_order_acquire) == CABINET_STOPPED))
+    {
+      profile->convproc.stop_process();
+      restart(&profile->convproc);
+      profile->cabinet_state.store(CABINET_FLUSHED, std::memory_order_release);
+    }
+  }
+}
+
+// Called with the mutex held
+void ProfileLoader::unpublish(stProfile *profile)
+{
+  published.erase(std::remove(published.begin(), published.end(), profile),
+                  published.end());
+}
+
+// Waits for level threads of a stopped 'convproc'
+// and starts it again with cleared history
+void ProfileLoader::restart(Convproc *convproc)
+{
+  if (convproc->state() == Convproc::ST_PROC)
+  {
+    return;
+  }
+
+  while (!convproc->check_stop())
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  convproc->start_process(CONVPROC_SCHEDULER_PRIORITY, CONVPROC_SCHEDULER_CLASS);
+}
+
+void ProfileLoader::run()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true)
+  {
+    if (!quit && !requested)
+    {
+      // Retired profiles and flush requests
+      // come from the audio thread without
+      // a wakeup, poll for them
+      cond.wait_for(lock, std::chrono::milliseconds(LOADER_POLL_TIME));
+    }
+
+    reclaim();
+    flush_cabinets();
+
+    if (quit)
+    {
+      break;
+    }
+
+    if (requested)
+    {
+      std::string path = requestPath;
+      float sampleRate = requestRate;
+      stIrOptions options = requestOptions;
+      std::shared_ptr<const TapfFile> master = requestMaster;
+      requestMaster = nullptr;
+      requested = false;
+      uint32_t loading = generation;
+
+      // Not taken by the audio thread yet
+      // and superseded by this request
+      stProfile *stale = ready.exchange(nullptr, std::memory_order_acq_rel);
+      if (stale)
+      {
+        unpublish(stale);
+      }
+
+      lock.unlock();
+
+      delete stale;
+
+      stProfile *fresh = load_profile(path.c_str(), sampleRate, options, master);
+      master = nullptr;
+
+      lock.lock();
+
+      if (fresh && (generation != loading))
+      {
+        // Superseded while loading
+        lock.unlock();
+        delete fresh;
+        lock.lock();
+      }
+      else if (fresh)
+      {
+        published.push_back(fresh);
+        ready.store(fresh, std::memory_order_release);
+      }
+    }
+  }
+}
+
+void ProfileLoader::suspend(stProfile *profile)
+{
+  if (profile)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    profile->preamp_convproc.stop_process();
+    profile->convproc.stop_process();
+    profile->suspended = true;
+  }
+}
+
+void ProfileLoader::resume(stProfile *profile)
+{
+  if (profile)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    profile->suspended = false;
+
+    // Clears input and output history
+    restart(&profile->preamp_convproc);
+    restart(&profile->convproc);
+    profile->cabinet_state.store(CABINET_FLUSHED, std::memory_order_release);
+  }
+}
+
+// Maps the file once and validates
+// the header and all IR blocks
+bool ProfileLoader::check_profile_file(const char *path)
+{
+  TapfFile tapf;
+  return tapf.open(path);
+}
+
+// Function loads profile from file at 'path',
+// or from its mapping 'master' when given,
+// and creates new convolvers using
+// IR data shared through IrCache
+stProfile* ProfileLoader::load_profile(const char *path, float sampleRate,
+                                       const stIrOptions &options,
+                                       std::shared_ptr<const TapfFile> master)
+{
+  if (!master)
+  {
+    std::shared_ptr<TapfFile> tapf = std::make_shared<TapfFile>();
+    if (!tapf->open(path))
+    {
+      return nullptr;
+    }
+    master = tapf;
+  }
+
+  std::shared_ptr<const stIrData> ir = IrCache::get(*master, sampleRate, options);
+  if (!ir)
+  {
+    return nullptr;
+  }
+
+  stProfile *p_profile = new stProfile();
+  p_profile->path = path;
+  p_profile->master = master;
+  p_profile->header = ir->header;
+  p_profile->ir = ir;
+
+  if (!IrCache::attach(*ir, &p_profile->preamp_convproc, &p_profile->convproc))
+  {
+    delete p_profile;
+    return nullptr;
+  }
+
+  p_profile->preamp_convproc.start_process(CONVPROC_SCHEDULER_PRIORITY,
+                                           CONVPROC_SCHEDULER_CLASS);
+  p_profile->convproc.start_process (CONVPROC_SCHEDULER_PRIORITY, CONVPROC_SCHEDULER_CLASS);
+
+  return p_profile;
+}
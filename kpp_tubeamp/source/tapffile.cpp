@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+#include "../include/tapffile.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TapfFile::~TapfFile()
+{
+  close();
+}
+
+bool TapfFile::open(const char *path)
+{
+  close();
+
+#ifdef _WIN32
+  HANDLE file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_handle == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+  file = file_handle;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file_handle, &file_size) || (file_size.QuadPart <= 0))
+  {
+    close();
+    return false;
+  }
+
+  mapping = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL)
+  {
+    close();
+    return false;
+  }
+
+  data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (data == NULL)
+  {
+    close();
+    return false;
+  }
+  size = (size_t)file_size.QuadPart;
+#else
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || (st.st_size <= 0))
+  {
+    ::close(fd);
+    return false;
+  }
+
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed
+  ::close(fd);
+  if (addr == MAP_FAILED)
+  {
+    return false;
+  }
+
+  data = (const char *)addr;
+  size = st.st_size;
+#endif
+
+  if (!validate())
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void TapfFile::close()
+{
+#ifdef _WIN32
+  if (data)
+  {
+    UnmapViewOfFile(data);
+  }
+  if (mapping)
+  {
+    CloseHandle(mapping);
+  }
+  if (file)
+  {
+    CloseHandle(file);
+  }
+  mapping = nullptr;
+  file = nullptr;
+#else
+  if (data)
+  {
+    munmap((void *)data, size);
+  }
+#endif
+
+  data = nullptr;
+  size = 0;
+  header = nullptr;
+  preamp_impulse = nullptr;
+  left_impulse = nullptr;
+  right_impulse = nullptr;
+  preamp_count = 0;
+  cabinet_count = 0;
+}
+
+// File layout: st_profile_header, then preamp IR,
+// then left and right cabinet IRs in any order.
+// Each IR is st_impulse_header followed by
+// 'sample_count' floats.
+bool TapfFile::validate()
+{
+  size_t pos = 0;
+
+  if (size < sizeof(st_profile_header))
+  {
+    return false;
+  }
+  header = (const st_profile_header *)data;
+  if (strncmp(header->signature, "TaPf", 4))
+  {
+    return false;
+  }
+  pos += sizeof(st_profile_header);
+
+  // Returns IR samples at 'pos' and moves past them,
+  // nullptr if the IR does not fit in the file
+  auto next_impulse = [this, &pos](const st_impulse_header **impheader) -> const float*
+  {
+    if (size - pos < sizeof(st_impulse_header))
+    {
+      return nullptr;
+    }
+    *impheader = (const st_impulse_header *)(data + pos);
+    pos += sizeof(st_impulse_header);
+
+    if (((*impheader)->sample_count <= 0) ||
+        ((size - pos) / sizeof(float) < (size_t)(*impheader)->sample_count))
+    {
+      return nullptr;
+    }
+    const float *samples = (const float *)(data + pos);
+    pos += (*impheader)->sample_count * sizeof(float);
+
+    return samples;
+  };
+
+  const st_impulse_header *impheader;
+
+  preamp_impulse = next_impulse(&impheader);
+  if (!preamp_impulse)
+  {
+    return false;
+  }
+  preamp_count = impheader->sample_count;
+
+  for (int i = 0; i < 2; i++)
+  {
+    const float *samples = next_impulse(&impheader);
+    if (!samples)
+    {
+      return false;
+    }
+
+    if ((i == 1) && ((uint32_t)impheader->sample_count != cabinet_count))
+    {
+      return false;
+    }
+    cabinet_count = impheader->sample_count;
+
+    if (impheader->channel == 0)
+    {
+      left_impulse = samples;
+    }
+    if (impheader->channel == 1)
+    {
+      right_impulse = samples;
+    }
+  }
+
+  return left_impulse && right_impulse;
+}
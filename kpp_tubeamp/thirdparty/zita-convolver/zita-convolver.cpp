@@ -24,6 +24,15 @@
 #include <stdio.h>
 #include "zita-convolver.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#if defined(ENABLE_VECTOR_MODE) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_HALF_SPECTRA
+#endif
+
 
 
 int zita_convolver_major_version (void)
@@ -38,6 +47,58 @@ int zita_convolver_minor_version (void)
 }
 
 
+pthread_mutex_t zita_convolver_fftw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int64_t monotonic_ns (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER c, f;
+
+    QueryPerformanceCounter (&c);
+    QueryPerformanceFrequency (&f);
+    return (c.QuadPart / f.QuadPart) * 1000000000
+         + (c.QuadPart % f.QuadPart) * 1000000000 / f.QuadPart;
+#else
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+
+static int online_cores (void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo (&info);
+    return info.dwNumberOfProcessors;
+#else
+    return sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+
+// Queue locks are taken by the audio thread in submit().
+// With priority inheritance a worker holding one runs at
+// the waiting thread's priority, other threads can not
+// keep it from releasing the lock.
+
+static void init_queue_lock (pthread_mutex_t *lock)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init (&attr);
+#if defined(_POSIX_THREAD_PRIO_INHERIT) && (_POSIX_THREAD_PRIO_INHERIT > 0)
+    pthread_mutexattr_setprotocol (&attr, PTHREAD_PRIO_INHERIT);
+#endif
+    pthread_mutex_init (lock, &attr);
+    pthread_mutexattr_destroy (&attr);
+}
+
+
 float Convproc::_mac_cost = 1.0f;
 float Convproc::_fft_cost = 5.0f;
 
@@ -69,7 +130,8 @@ Convproc::Convproc (void) :
     _minpart (0),
     _maxpart (0),
     _nlevels (0),
-    _latecnt (0)
+    _latecnt (0),
+    _arena (0)
 {
     memset (_inpbuff, 0, MAXINP * sizeof (float *));
     memset (_outbuff, 0, MAXOUT * sizeof (float *));
@@ -179,6 +241,16 @@ int Convproc::configure (uint32_t  ninp,
 	 
 	for (i = 0; i < ninp; i++) _inpbuff [i] = new float [_inpsize];
 	for (i = 0; i < nout; i++) _outbuff [i] = new float [_minpart];
+
+	// Spectra and output buffers of all levels in
+	// one block, each level's part in MAC order
+	for (i = 0, size = 0; i < _nlevels; i++) size += _convlev [i]->arena_size (ninp, nout);
+	_arena = calloc_real (size);
+	for (i = 0, size = 0; i < _nlevels; i++)
+	{
+	    _convlev [i]->attach (_arena + size, ninp, nout);
+	    size += _convlev [i]->arena_size (ninp, nout);
+	}
     }
     catch (...)
     {
@@ -274,6 +346,41 @@ int Convproc::impdata_link (uint32_t inp1,
 }
 
 
+int Convproc::impdata_share (const Convproc *source,
+                             uint32_t  inp,
+                             uint32_t  out)
+{
+    uint32_t j;
+
+    if ((inp >= _ninp) || (out >= _nout)) return Converror::BAD_PARAM;
+    if ((inp >= source->_ninp) || (out >= source->_nout)) return Converror::BAD_PARAM;
+    if (   (_nlevels != source->_nlevels)
+        || (_quantum != source->_quantum)
+        || (_minpart != source->_minpart)) return Converror::BAD_PARAM;
+    for (j = 0; j < _nlevels; j++)
+    {
+        if (   (_convlev [j]->_offs != source->_convlev [j]->_offs)
+            || (_convlev [j]->_npar != source->_convlev [j]->_npar)
+            || (_convlev [j]->_parsize != source->_convlev [j]->_parsize)
+            || (_convlev [j]->_options != source->_convlev [j]->_options)) return Converror::BAD_PARAM;
+    }
+    if (_state != ST_STOP) return Converror::BAD_STATE;
+    try
+    {
+        for (j = 0; j < _nlevels; j++)
+	{
+            _convlev [j]->impdata_share (source->_convlev [j], inp, out);
+	}
+    }
+    catch (...)
+    {
+	cleanup ();
+	return Converror::MEM_ALLOC;
+    }
+    return 0;
+}
+
+
 int Convproc::reset (void)
 {
     uint32_t k;
@@ -369,6 +476,8 @@ int Convproc::cleanup (void)
 	delete _convlev [k];
 	_convlev [k] = 0;
     }
+    fftwf_free (_arena);
+    _arena = 0;
 
     _state = ST_IDLE;
     _options = 0;
@@ -388,7 +497,9 @@ bool Convproc::check_stop (void)
 {
     uint32_t k;
 
-    for (k = 0; (k < _nlevels) && (_convlev [k]->_stat == Convlevel::ST_IDLE); k++);
+    // Acquire pairs with the release in Convlevel::cycle(),
+    // the pool is done with a level seen idle here
+    for (k = 0; (k < _nlevels) && (_convlev [k]->_stat.load (std::memory_order_acquire) == Convlevel::ST_IDLE); k++);
     if (k == _nlevels)
     {
 	_state = ST_STOP;
@@ -407,17 +518,255 @@ void Convproc::print (FILE *F)
 
 
 
+// Frequency domain multiply-accumulate, D += A * B over
+// bins 0 to n. Vector kernels take spectra in groups of
+// split real and imaginary parts, see fftsplit(). The
+// Nyquist bin stays interleaved and is real.
+
+static void mac_scalar (fftwf_complex *D, const fftwf_complex *A,
+                        const fftwf_complex *B, uint32_t n)
+{
+    uint32_t k;
+
+    for (k = 0; k <= n; k++)
+    {
+	D [k][0] += A [k][0] * B [k][0] - A [k][1] * B [k][1];
+	D [k][1] += A [k][0] * B [k][1] + A [k][1] * B [k][0];
+    }
+}
+
+
+#ifdef ENABLE_VECTOR_MODE
+
 typedef float FV4 __attribute__ ((vector_size(16)));
 
 
+static void mac_fv4 (fftwf_complex *D, const fftwf_complex *A,
+                     const fftwf_complex *B, uint32_t n)
+{
+    uint32_t  k;
+    FV4       *d = (FV4 *) D;
+    const FV4 *a = (const FV4 *) A;
+    const FV4 *b = (const FV4 *) B;
+
+    for (k = 0; k < n; k += 4)
+    {
+	d [0] += a [0] * b [0] - a [1] * b [1];
+	d [1] += a [0] * b [1] + a [1] * b [0];
+	a += 2;
+	b += 2;
+	d += 2;
+    }
+    D [n][0] += A [n][0] * B [n][0];
+    D [n][1] = 0;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__ ((target ("avx2,fma")))
+static void mac_avx2 (fftwf_complex *D, const fftwf_complex *A,
+                      const fftwf_complex *B, uint32_t n)
+{
+    uint32_t k;
+    float    *d = (float *) D;
+    const float *a = (const float *) A;
+    const float *b = (const float *) B;
+    __m256   ar, ai, br, bi, dr, di;
+
+    for (k = 0; k < n; k += 8)
+    {
+	ar = _mm256_loadu_ps (a);
+	ai = _mm256_loadu_ps (a + 8);
+	br = _mm256_loadu_ps (b);
+	bi = _mm256_loadu_ps (b + 8);
+	dr = _mm256_fmadd_ps (ar, br, _mm256_loadu_ps (d));
+	di = _mm256_fmadd_ps (ar, bi, _mm256_loadu_ps (d + 8));
+	_mm256_storeu_ps (d, _mm256_fnmadd_ps (ai, bi, dr));
+	_mm256_storeu_ps (d + 8, _mm256_fmadd_ps (ai, br, di));
+	a += 16;
+	b += 16;
+	d += 16;
+    }
+    D [n][0] += A [n][0] * B [n][0];
+    D [n][1] = 0;
+}
+
+
+__attribute__ ((target ("avx512f")))
+static void mac_avx512 (fftwf_complex *D, const fftwf_complex *A,
+                        const fftwf_complex *B, uint32_t n)
+{
+    uint32_t k;
+    float    *d = (float *) D;
+    const float *a = (const float *) A;
+    const float *b = (const float *) B;
+    __m512   ar, ai, br, bi, dr, di;
+
+    for (k = 0; k < n; k += 16)
+    {
+	ar = _mm512_loadu_ps (a);
+	ai = _mm512_loadu_ps (a + 16);
+	br = _mm512_loadu_ps (b);
+	bi = _mm512_loadu_ps (b + 16);
+	dr = _mm512_fmadd_ps (ar, br, _mm512_loadu_ps (d));
+	di = _mm512_fmadd_ps (ar, bi, _mm512_loadu_ps (d + 16));
+	_mm512_storeu_ps (d, _mm512_fnmadd_ps (ai, bi, dr));
+	_mm512_storeu_ps (d + 16, _mm512_fmadd_ps (ai, br, di));
+	a += 32;
+	b += 32;
+	d += 32;
+    }
+    D [n][0] += A [n][0] * B [n][0];
+    D [n][1] = 0;
+}
+
+#endif
+
+
+#ifdef HAVE_HALF_SPECTRA
+
+// Same as above with B in half precision, scaled by s.
+
+__attribute__ ((target ("avx2,fma,f16c")))
+static void mac_avx2_h (fftwf_complex *D, const fftwf_complex *A,
+                        const uint16_t *B, float s, uint32_t n)
+{
+    uint32_t k;
+    float    *d = (float *) D;
+    const float *a = (const float *) A;
+    const uint16_t *b = B;
+    __m256   ar, ai, br, bi, dr, di, sc;
+
+    sc = _mm256_set1_ps (s);
+    for (k = 0; k < n; k += 8)
+    {
+	ar = _mm256_loadu_ps (a);
+	ai = _mm256_loadu_ps (a + 8);
+	br = _mm256_mul_ps (sc, _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *) b)));
+	bi = _mm256_mul_ps (sc, _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *)(b + 8))));
+	dr = _mm256_fmadd_ps (ar, br, _mm256_loadu_ps (d));
+	di = _mm256_fmadd_ps (ar, bi, _mm256_loadu_ps (d + 8));
+	_mm256_storeu_ps (d, _mm256_fnmadd_ps (ai, bi, dr));
+	_mm256_storeu_ps (d + 8, _mm256_fmadd_ps (ai, br, di));
+	a += 16;
+	b += 16;
+	d += 16;
+    }
+    D [n][0] += A [n][0] * s * _cvtsh_ss (b [0]);
+    D [n][1] = 0;
+}
+
+
+__attribute__ ((target ("avx512f,f16c")))
+static void mac_avx512_h (fftwf_complex *D, const fftwf_complex *A,
+                          const uint16_t *B, float s, uint32_t n)
+{
+    uint32_t k;
+    float    *d = (float *) D;
+    const float *a = (const float *) A;
+    const uint16_t *b = B;
+    __m512   ar, ai, br, bi, dr, di, sc;
+
+    // The zero masked conversion, the plain one makes
+    // GCC warn about its undefined pass-through operand
+    sc = _mm512_set1_ps (s);
+    for (k = 0; k < n; k += 16)
+    {
+	ar = _mm512_loadu_ps (a);
+	ai = _mm512_loadu_ps (a + 16);
+	br = _mm512_mul_ps (sc, _mm512_maskz_cvtph_ps (0xFFFF, _mm256_loadu_si256 ((const __m256i *) b)));
+	bi = _mm512_mul_ps (sc, _mm512_maskz_cvtph_ps (0xFFFF, _mm256_loadu_si256 ((const __m256i *)(b + 16))));
+	dr = _mm512_fmadd_ps (ar, br, _mm512_loadu_ps (d));
+	di = _mm512_fmadd_ps (ar, bi, _mm512_loadu_ps (d + 16));
+	_mm512_storeu_ps (d, _mm512_fnmadd_ps (ai, bi, dr));
+	_mm512_storeu_ps (d + 16, _mm512_fmadd_ps (ai, br, di));
+	a += 32;
+	b += 32;
+	d += 32;
+    }
+    D [n][0] += A [n][0] * s * _cvtsh_ss (b [0]);
+    D [n][1] = 0;
+}
+
+
+// D += s * H over n values, n even.
+
+__attribute__ ((target ("avx,f16c")))
+static void half_widen (float *D, const uint16_t *H, float s, uint32_t n)
+{
+    uint32_t k;
+    __m256   sc;
+
+    sc = _mm256_set1_ps (s);
+    for (k = 0; k + 8 <= n; k += 8)
+    {
+	_mm256_storeu_ps (D + k, _mm256_add_ps (_mm256_loadu_ps (D + k),
+	                  _mm256_mul_ps (sc, _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *)(H + k))))));
+    }
+    for (; k < n; k++) D [k] += s * _cvtsh_ss (H [k]);
+}
+
+
+// H = s * F over n values, rounded to nearest.
+
+__attribute__ ((target ("avx,f16c")))
+static void half_narrow (uint16_t *H, const float *F, float s, uint32_t n)
+{
+    uint32_t k;
+    __m256   sc;
+
+    sc = _mm256_set1_ps (s);
+    for (k = 0; k + 8 <= n; k += 8)
+    {
+	_mm_storeu_si128 ((__m128i *)(H + k),
+	                  _mm256_cvtps_ph (_mm256_mul_ps (sc, _mm256_loadu_ps (F + k)), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; k < n; k++) H [k] = _cvtss_sh (s * F [k], _MM_FROUND_TO_NEAREST_INT);
+}
+
+#endif
+
+
+// Widest kernel the CPU runs, checked once.
+
+static uint32_t vector_width (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx512f")) return 16;
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma")) return 8;
+#endif
+    return 4;
+}
+
+#endif
+
+
 Convlevel::Convlevel (void) :
     _stat (ST_IDLE),
     _npar (0),
     _parsize (0),
     _options (0),
-    _pthr (0),
-    _inp_list (0),
-    _out_list (0),
+    _vecw (1),
+    _mac (mac_scalar),
+    _half (false),
+    _mach (0),
+    _pending (0),
+    _due (0),
+    _last (0),
+    _deadline (0),
+    _home (0),
+    _qnext (0),
+    _inpv (0),
+    _outv (0),
+    _ninpv (0),
+    _noutv (0),
+    _maxinp (0),
+    _maxout (0),
+    _cstride (0),
+    _ffta_data (0),
+    _outb_data (0),
     _plan_r2c (0),
     _plan_c2r (0),
     _time_data (0),
@@ -447,17 +796,73 @@ void Convlevel::configure (int       prio,
     _npar = npar;
     _parsize = parsize;
     _options = options;
+    _cstride = (_parsize + 8) & ~7;
+    _vecw = 1;
+    _mac = mac_scalar;
+    _half = false;
+    _mach = 0;
+#ifdef ENABLE_VECTOR_MODE
+    if (_options & OPT_VECTOR_MODE)
+    {
+        static const uint32_t width = vector_width ();
+
+        _vecw = width;
+        _mac = mac_fv4;
+#if defined(__x86_64__) || defined(__i386__)
+        if (_vecw == 16) _mac = mac_avx512;
+        if (_vecw == 8) _mac = mac_avx2;
+#endif
+#ifdef HAVE_HALF_SPECTRA
+	static const bool f16c = __builtin_cpu_supports ("f16c");
+
+        if ((_options & OPT_HALF_SPECTRA) && (_vecw >= 8) && f16c)
+        {
+            _half = true;
+            _mach = (_vecw == 16) ? mac_avx512_h : mac_avx2_h;
+        }
+#endif
+    }
+#endif
     
     _time_data = calloc_real (2 * _parsize);
     _prep_data = calloc_real (2 * _parsize);
     _freq_data = calloc_complex (_parsize + 1);
+    pthread_mutex_lock (&zita_convolver_fftw_lock);
     _plan_r2c = fftwf_plan_dft_r2c_1d (2 * _parsize, _time_data, _freq_data, fftwopt);
     _plan_c2r = fftwf_plan_dft_c2r_1d (2 * _parsize, _freq_data, _time_data, fftwopt);
+    pthread_mutex_unlock (&zita_convolver_fftw_lock);
     if (_plan_r2c && _plan_c2r) return;
     throw (Converror (Converror::MEM_ALLOC));
 }
 
 
+// Floats of the Convproc arena used by this level: the
+// accumulator, the input spectra and the output buffers.
+// Spectra are padded to 64 bytes.
+
+uint32_t Convlevel::arena_size (uint32_t ninp, uint32_t nout)
+{
+    return 2 * _cstride * (1 + ninp * _npar) + 3 * nout * _parsize;
+}
+
+
+void Convlevel::attach (float *data, uint32_t ninp, uint32_t nout)
+{
+    // Plans were made on a buffer of its own,
+    // executing them needs the same alignment only
+    fftwf_free (_freq_data);
+    _freq_data = (fftwf_complex *) data;
+    _ffta_data = _freq_data + _cstride;
+    _outb_data = (float *)(_ffta_data + ninp * _npar * _cstride);
+    _maxinp = ninp;
+    _maxout = nout;
+    _inpv = new Inpnode * [ninp];
+    _outv = new Outnode * [nout];
+    _ninpv = 0;
+    _noutv = 0;
+}
+
+
 void Convlevel::impdata_write (uint32_t  inp,
                                uint32_t  out,
                                int32_t   step,
@@ -481,7 +886,7 @@ void Convlevel::impdata_write (uint32_t  inp,
     {
         M = findmacnode (inp, out, true);
 	if (M == 0 || M->_link) return;
-	if (M->_fftb == 0) M->alloc_fftb (_npar);
+	if (M->_fftb == 0) M->alloc_fftb (_npar, _cstride, _half);
     }
     else
     {
@@ -498,7 +903,9 @@ void Convlevel::impdata_write (uint32_t  inp,
 	    fftb = M->_fftb [k];
             if (fftb == 0 && create)
             {
-		M->_fftb [k] = fftb = calloc_complex (_parsize + 1);
+		// Half precision partitions take half the stride
+		M->_fftb [k] = fftb = _half ? (fftwf_complex *)((uint16_t *) M->_fftd + 2 * k * _cstride)
+		                            : M->_fftd + k * _cstride;
 	    }
 	    if (fftb && data)
 	    {
@@ -508,12 +915,19 @@ void Convlevel::impdata_write (uint32_t  inp,
 	        for (j = j0; j < j1; j++) _prep_data [j - i0] = norm * data [j * step];
 	        fftwf_execute_dft_r2c (_plan_r2c, _prep_data, _freq_data);
 #ifdef ENABLE_VECTOR_MODE
-	        if (_options & OPT_VECTOR_MODE) fftswap (_freq_data);
+	        if (_vecw > 1) fftsplit (_freq_data);
 #endif
-	        for (j = 0; j <= (int)_parsize; j++)
+	        if (_half)
+	        {
+		    halfwrite ((uint16_t *) fftb, M->_fftscale + k);
+		}
+	        else
 	        {
-	            fftb [j][0] += _freq_data [j][0];
-	            fftb [j][1] += _freq_data [j][1];
+		    for (j = 0; j <= (int)_parsize; j++)
+		    {
+		        fftb [j][0] += _freq_data [j][0];
+		        fftb [j][1] += _freq_data [j][1];
+		    }
 		}
 	    }
 	}
@@ -533,7 +947,7 @@ void Convlevel::impdata_clear (uint32_t inp, uint32_t out)
     {
         if (M->_fftb [i])
         {
-  	    memset (M->_fftb [i], 0, (_parsize + 1) * sizeof (fftwf_complex));
+  	    memset (M->_fftb [i], 0, (_parsize + 1) * (_half ? 2 * sizeof (uint16_t) : sizeof (fftwf_complex)));
 	}
     }
 }
@@ -551,7 +965,22 @@ void Convlevel::impdata_link (uint32_t inp1,
     if (! M1) return;
     M2 = findmacnode (inp2, out2, true);
     M2->free_fftb ();	
-    M2->_link = M1;
+    M2->_link = M1->_link ? M1->_link : M1;
+}
+
+
+void Convlevel::impdata_share (Convlevel *source,
+                               uint32_t  inp,
+                               uint32_t  out)
+{
+    Macnode  *M1;
+    Macnode  *M2;
+
+    M1 = source->findmacnode (inp, out, false);
+    if (! M1) return;
+    M2 = findmacnode (inp, out, true);
+    M2->free_fftb ();
+    M2->_link = M1->_link ? M1->_link : M1;
 }
 
 
@@ -560,7 +989,7 @@ void Convlevel::reset (uint32_t  inpsize,
 		       float         **inpbuff,
 		       float         **outbuff)
 {
-    uint32_t     i;
+    uint32_t     i, j;
     Inpnode      *X; 
     Outnode      *Y; 
 
@@ -568,15 +997,18 @@ void Convlevel::reset (uint32_t  inpsize,
     _outsize = outsize;
     _inpbuff = inpbuff;
     _outbuff = outbuff;
-    for (X = _inp_list; X; X = X->_next)
+    for (j = 0; j < _ninpv; j++)
     {
+        X = _inpv [j];
         for (i = 0; i < _npar; i++)
 	{
             memset (X->_ffta [i], 0, (_parsize + 1) * sizeof (fftwf_complex));
+            X->_zero [i] = true;
 	}
     }
-    for (Y = _out_list; Y; Y = Y->_next) 
+    for (j = 0; j < _noutv; j++)
     {
+        Y = _outv [j];
 	for (i = 0; i < 3; i++)
 	{
             memset (Y->_buff [i], 0, _parsize * sizeof (float));
@@ -596,120 +1028,121 @@ void Convlevel::reset (uint32_t  inpsize,
     _wait = 0;
     _ptind = 0;
     _opind = 0;
-    _trig.init (0, 0);
     _done.init (0, 0);
+    _pending = 0;
+    _last = 0;
 }
 
 
 void Convlevel::start (int abspri, int policy)
 {
-    int                min, max;
-    pthread_attr_t     attr;
-    struct sched_param parm;
+    Convpool *P = Convpool::instance ();
 
-    _pthr = 0;
-    min = sched_get_priority_min (policy);
-    max = sched_get_priority_max (policy);
-    abspri += _prio;
-    if (abspri > max) abspri = max;
-    if (abspri < min) abspri = min;
-    parm.sched_priority = abspri;
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-    pthread_attr_setschedpolicy (&attr, policy);
-    pthread_attr_setschedparam (&attr, &parm);
-    pthread_attr_setscope (&attr, PTHREAD_SCOPE_SYSTEM);
-    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
-    pthread_attr_setstacksize (&attr, 0x10000);
-    pthread_create (&_pthr, &attr, static_main, this);
-    pthread_attr_destroy (&attr);
+    // Without pool threads the level
+    // stays idle and runs inline
+    if (! P->start (abspri, policy)) return;
+    _home = P->_next++ % P->_nthr;
+    _stat.store (ST_PROC, std::memory_order_release);
 }
 
 
 void Convlevel::stop (void)
 {
-    if (_stat != ST_IDLE)
+    if (_stat.load (std::memory_order_acquire) != ST_IDLE)
     {
-        _stat = ST_TERM;
-	_trig.post ();
+        _stat.store (ST_TERM, std::memory_order_release);
+        if (_pending++ == 0) Convpool::instance ()->submit (this);
     }
 }
 
 
-void Convlevel::cleanup (void)
+// Audio thread: queues a cycle, due one
+// trigger interval from now.
+
+void Convlevel::trigger (void)
 {
-    Inpnode       *X, *X1;
-    Outnode       *Y, *Y1;
-    Macnode       *M, *M1;
+    int64_t t = monotonic_ns ();
 
-    X = _inp_list;
-    while (X)
+    _due = (_last) ? 2 * t - _last : t;
+    _last = t;
+    if (_pending++ == 0) Convpool::instance ()->submit (this);
+}
+
+
+// Pool worker: runs one cycle, the next
+// one if it was triggered meanwhile.
+
+void Convlevel::cycle (void)
+{
+    if (_stat.load (std::memory_order_acquire) == ST_TERM)
     {
-	X1 = X->_next;
-	delete X;
-	X = X1;
+        _pending = 0;
+        _stat.store (ST_IDLE, std::memory_order_release);
+        return;
     }
-    _inp_list = 0;
+    process (false);
+    _done.post ();
+    if (--_pending > 0) Convpool::instance ()->submit (this);
+}
+
+
+void Convlevel::cleanup (void)
+{
+    uint32_t      i, j;
+    Outnode       *Y;
 
-    Y = _out_list;
-    while (Y)
+    for (i = 0; i < _ninpv; i++) delete _inpv [i];
+    for (i = 0; i < _noutv; i++)
     {
-	M = Y->_list;
-	while (M)
-	{
-	    M1 = M->_next;
-	    delete M;
-	    M = M1;
-	}
-	Y1 = Y->_next;
+	Y = _outv [i];
+	for (j = 0; j < Y->_nmac; j++) delete Y->_macv [j];
 	delete Y;
-	Y = Y1;
     }
-    _out_list = 0;
-
+    delete[] _inpv;
+    delete[] _outv;
+    _inpv = 0;
+    _outv = 0;
+    _ninpv = 0;
+    _noutv = 0;
+
+    pthread_mutex_lock (&zita_convolver_fftw_lock);
     fftwf_destroy_plan (_plan_r2c);
     fftwf_destroy_plan (_plan_c2r);
+    pthread_mutex_unlock (&zita_convolver_fftw_lock);
     fftwf_free (_time_data);
     fftwf_free (_prep_data);
-    fftwf_free (_freq_data);
+    // Owned by the Convproc arena once attached
+    if (! _ffta_data) fftwf_free (_freq_data);
     _plan_r2c = 0;
     _plan_c2r = 0;
     _time_data = 0;
     _prep_data = 0;
     _freq_data = 0;
+    _ffta_data = 0;
+    _outb_data = 0;
 }
 
 
-void *Convlevel::static_main (void *arg)
-{
-    ((Convlevel *) arg)->main ();
-    return 0;
-}
+// True if all n samples are zero.
 
-
-void Convlevel::main (void)
+static bool zero_block (const float *p, uint32_t n)
 {
-    _stat = ST_PROC;
-    while (true)
+    uint32_t k;
+
+    for (k = 0; k < n; k++)
     {
-	_trig.wait ();
-	if (_stat == ST_TERM)
-	{
-            _stat = ST_IDLE;
-	    _pthr = 0;
-            return;
-        }
-	process (false);
-	_done.post ();
+	if (p [k] != 0.0f) return false;
     }
+    return true;
 }
 
 
 void Convlevel::process (bool skip)
 {
-    uint32_t        i, i1, j, k, n1, n2, opi1, opi2;
+    uint32_t        i, i1, j, k, n1, n2, opi1, opi2, ix, iy, im, nm;
     Inpnode         *X;
     Macnode         *M;
+    Macnode         *L;
     Outnode         *Y;
     fftwf_complex   *ffta;
     fftwf_complex   *fftb;
@@ -730,75 +1163,67 @@ void Convlevel::process (bool skip)
     opi1 = (_opind + 1) % 3;
     opi2 = (_opind + 2) % 3;
 
-    for (X = _inp_list; X; X = X->_next)
+    for (ix = 0; ix < _ninpv; ix++)
     {
+	X = _inpv [ix];
 	inpd = _inpbuff [X->_inp];
 	if (n1) memcpy (_time_data, inpd + i1, n1 * sizeof (float));
 	if (n2) memcpy (_time_data + n1, inpd, n2 * sizeof (float));
+	// Zero input has a zero spectrum, it is
+	// neither computed nor multiplied
+	X->_zero [_ptind] = zero_block (_time_data, _parsize);
+	if (X->_zero [_ptind]) continue;
 	memset (_time_data + _parsize, 0, _parsize * sizeof (float));
 	fftwf_execute_dft_r2c (_plan_r2c, _time_data, X->_ffta [_ptind]);
 #ifdef ENABLE_VECTOR_MODE
-	if (_options & OPT_VECTOR_MODE) fftswap (X->_ffta [_ptind]);
+	if (_vecw > 1) fftsplit (X->_ffta [_ptind]);
 #endif
     }
 
     if (skip)
     {
-        for (Y = _out_list; Y; Y = Y->_next)
+        for (iy = 0; iy < _noutv; iy++)
 	{
-	    outd = Y->_buff [opi2];
+	    outd = _outv [iy]->_buff [opi2];
 	    memset (outd, 0, _parsize * sizeof (float));
 	}
     }
     else
     {
-	for (Y = _out_list; Y; Y = Y->_next)
+	for (iy = 0; iy < _noutv; iy++)
 	{
-	    memset (_freq_data, 0, (_parsize + 1) * sizeof (fftwf_complex));
-	    for (M = Y->_list; M; M = M->_next)
+	    Y = _outv [iy];
+	    nm = 0;
+	    for (im = 0; im < Y->_nmac; im++)
 	    {
+		M = Y->_macv [im];
 		X = M->_inpn;
 		i = _ptind;
 		for (j = 0; j < _npar; j++)
 		{
 		    ffta = X->_ffta [i];
-		    fftb = M->_link ? M->_link->_fftb [j] : M->_fftb [j];
-		    if (fftb)
+		    L = M->_link ? M->_link : M;
+		    fftb = L->_fftb [j];
+		    if (fftb && !X->_zero [i])
 		    {
-#ifdef ENABLE_VECTOR_MODE
-			if (_options & OPT_VECTOR_MODE)
-			{
-			    FV4 *A = (FV4 *) ffta;
-			    FV4 *B = (FV4 *) fftb;
-			    FV4 *D = (FV4 *) _freq_data;
-			    for (k = 0; k < _parsize; k += 4)
-			    {
-				D [0] += A [0] * B [0] - A [1] * B [1];
-				D [1] += A [0] * B [1] + A [1] * B [0];
-				A += 2;
-				B += 2;
-				D += 2;
-			    }
-			    _freq_data [_parsize][0] += ffta [_parsize][0] * fftb [_parsize][0];
-			    _freq_data [_parsize][1] = 0;
-			}
-			else
-#endif
-			{
-			    for (k = 0; k <= _parsize; k++)
-			    {
-				_freq_data [k][0] += ffta [k][0] * fftb [k][0] - ffta [k][1] * fftb [k][1];
-				_freq_data [k][1] += ffta [k][0] * fftb [k][1] + ffta [k][1] * fftb [k][0];
-			    }
-			}
+			if (nm++ == 0) memset (_freq_data, 0, (_parsize + 1) * sizeof (fftwf_complex));
+			if (_half) _mach (_freq_data, ffta, (const uint16_t *) fftb, L->_fftscale [j], _parsize);
+			else _mac (_freq_data, ffta, fftb, _parsize);
 		    }
 		    if (i == 0) i = _npar;
 		    i--;
 		}
 	    }
 
+	    if (nm == 0)
+	    {
+		// Nothing to add, the next part is silent
+		memset (Y->_buff [opi2], 0, _parsize * sizeof (float));
+		continue;
+	    }
+
 #ifdef ENABLE_VECTOR_MODE
-	    if (_options & OPT_VECTOR_MODE) fftswap (_freq_data);
+	    if (_vecw > 1) fftjoin (_freq_data);
 #endif
 	    fftwf_execute_dft_c2r (_plan_c2r, _freq_data, _time_data);
 	    outd = Y->_buff [opi1];
@@ -815,7 +1240,7 @@ void Convlevel::process (bool skip)
 
 int Convlevel::readout (bool sync, uint32_t skipcnt)
 {
-    uint32_t   i;
+    uint32_t   i, j;
     float      *p, *q;	
     Outnode    *Y;
 
@@ -823,7 +1248,7 @@ int Convlevel::readout (bool sync, uint32_t skipcnt)
     if (_outoffs == _parsize)
     {
 	_outoffs = 0;
-	if (_stat == ST_PROC)
+	if (_stat.load (std::memory_order_acquire) == ST_PROC)
 	{
    	    while (_wait)
 	    {
@@ -832,7 +1257,7 @@ int Convlevel::readout (bool sync, uint32_t skipcnt)
   	        _wait--;
 	    }
 	    if (++_opind == 3) _opind = 0;
-            _trig.post ();
+            trigger ();
 	    _wait++;
 	}
         else
@@ -842,8 +1267,9 @@ int Convlevel::readout (bool sync, uint32_t skipcnt)
 	}
     }
 
-    for (Y = _out_list; Y; Y = Y->_next)
+    for (j = 0; j < _noutv; j++)
     {
+        Y = _outv [j];
         p = Y->_buff [_opind] + _outoffs;
         q = _outbuff [Y->_out];
         for (i = 0; i < _outsize; i++) q [i] += p [i];
@@ -861,36 +1287,37 @@ void Convlevel::print (FILE *F)
 
 Macnode *Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 {
+    uint32_t  i;
     Inpnode   *X;
     Outnode   *Y;
     Macnode   *M;
 
-    for (X = _inp_list; X && (X->_inp != inp); X = X->_next);
-    if (! X)
+    for (i = 0; (i < _ninpv) && (_inpv [i]->_inp != inp); i++);
+    if (i < _ninpv) X = _inpv [i];
+    else
     {
 	if (! create) return 0;
 	X = new Inpnode (inp);
-	X->_next = _inp_list;
-	_inp_list = X;
-	X->alloc_ffta (_npar, _parsize);
+	X->set_ffta (_npar, _ffta_data + inp * _npar * _cstride, _cstride);
+	_inpv [_ninpv++] = X;
     }
 
-    for (Y = _out_list; Y && (Y->_out != out); Y = Y->_next);
-    if (! Y)
+    for (i = 0; (i < _noutv) && (_outv [i]->_out != out); i++);
+    if (i < _noutv) Y = _outv [i];
+    else
     {
 	if (! create) return 0;
-	Y = new Outnode (out, _parsize);
-	Y->_next = _out_list;
-	_out_list = Y;
+	Y = new Outnode (out, _outb_data + 3 * out * _parsize, _parsize, _maxinp);
+	_outv [_noutv++] = Y;
     }
 
-    for (M = Y->_list; M && (M->_inpn != X); M = M->_next);
-    if (! M)
+    for (i = 0; (i < Y->_nmac) && (Y->_macv [i]->_inpn != X); i++);
+    if (i < Y->_nmac) M = Y->_macv [i];
+    else
     {
 	if (! create) return 0;
 	M = new Macnode (X);
-	M->_next = Y->_list;
-	Y->_list = M;
+	Y->_macv [Y->_nmac++] = M;
     }
 
     return M;
@@ -899,30 +1326,76 @@ Macnode *Convlevel::findmacnode (uint32_t inp, uint32_t out, bool create)
 
 #ifdef ENABLE_VECTOR_MODE
 
-void Convlevel::fftswap (fftwf_complex *p)
+// Rearranges bins 0 to _parsize - 1 into groups of _vecw
+// real parts followed by _vecw imaginary parts.
+
+void Convlevel::fftsplit (fftwf_complex *p)
 {
-    uint32_t  n = _parsize;
-    float     a, b;
+    uint32_t  i, n;
+    float     t [32];
+    float     *q = (float *) p;
 
-    while (n)
+    for (n = 0; n < _parsize; n += _vecw)
     {
-	a = p [2][0];
-	b = p [3][0];
-        p [2][0] = p [0][1];
-        p [3][0] = p [1][1];
-        p [0][1] = a;
-        p [1][1] = b;
-	p += 4;
-        n -= 4;
+	memcpy (t, q, 2 * _vecw * sizeof (float));
+	for (i = 0; i < _vecw; i++)
+	{
+	    q [i] = t [2 * i];
+	    q [_vecw + i] = t [2 * i + 1];
+	}
+	q += 2 * _vecw;
     }
 }
 
+
+void Convlevel::fftjoin (fftwf_complex *p)
+{
+    uint32_t  i, n;
+    float     t [32];
+    float     *q = (float *) p;
+
+    for (n = 0; n < _parsize; n += _vecw)
+    {
+	memcpy (t, q, 2 * _vecw * sizeof (float));
+	for (i = 0; i < _vecw; i++)
+	{
+	    q [2 * i] = t [i];
+	    q [2 * i + 1] = t [_vecw + i];
+	}
+	q += 2 * _vecw;
+    }
+}
+
+#endif
+
+
+// Adds _freq_data to a half precision partition and stores
+// the sum again, scaled so its largest value is 2^15.
+
+void Convlevel::halfwrite (uint16_t *fftb, float *scale)
+{
+#ifdef HAVE_HALF_SPECTRA
+    uint32_t  k, n;
+    float     m;
+    float     *f = (float *) _freq_data;
+
+    n = 2 * (_parsize + 1);
+    half_widen (f, fftb, *scale, n);
+    m = 0;
+    for (k = 0; k < n; k++)
+    {
+	if (f [k] > m) m = f [k];
+	else if (-f [k] > m) m = -f [k];
+    }
+    *scale = m / 32768.0f;
+    half_narrow (fftb, f, (m > 0) ? 32768.0f / m : 0.0f, n);
 #endif
+}
 
 
 Inpnode::Inpnode (uint16_t inp):
-    _next (0),
     _ffta (0),	
+    _zero (0),
     _npar (0),
     _inp (inp)
 {
@@ -935,35 +1408,35 @@ Inpnode::~Inpnode (void)
 }
     
 
-void Inpnode::alloc_ffta (uint16_t npar, int32_t size)
+void Inpnode::set_ffta (uint16_t npar, fftwf_complex *data, uint32_t stride)
 {
     _npar = npar;
     _ffta = new fftwf_complex * [_npar];
+    _zero = new bool [_npar];
     for (int i = 0; i < _npar; i++)
     {
-        _ffta [i] = calloc_complex (size + 1);
+        _ffta [i] = data + i * stride;
+        _zero [i] = true;
     }
 }
 
 
 void Inpnode::free_ffta (void)
 {
-    if (!_ffta) return;
-    for (uint16_t i = 0; i < _npar; i++)
-    {
-        fftwf_free ( _ffta [i]);
-    }
     delete[] _ffta;
+    delete[] _zero;
     _ffta = 0;
+    _zero = 0;
     _npar = 0;
 }
 
 
 Macnode::Macnode (Inpnode *inpn):
-    _next (0),
     _inpn (inpn),
     _link (0),
     _fftb (0),
+    _fftd (0),
+    _fftscale (0),
     _npar (0)
 {}
 
@@ -974,44 +1447,252 @@ Macnode::~Macnode (void)
 }
 
 
-void Macnode::alloc_fftb (uint16_t npar)
+// Partitions are one block in MAC order, a partition
+// is used once impdata_write() has put data into it.
+// Half precision partitions have a scale each.
+
+void Macnode::alloc_fftb (uint16_t npar, uint32_t stride, bool half)
 {
     _npar = npar;
+    _fftd = calloc_complex (half ? _npar * stride / 2 : _npar * stride);
     _fftb = new fftwf_complex * [_npar];
     for (uint16_t i = 0; i < _npar; i++)
     {
         _fftb [i] = 0;
     }
+    if (half)
+    {
+        _fftscale = new float [_npar];
+        memset (_fftscale, 0, _npar * sizeof (float));
+    }
 }
 
 
 void Macnode::free_fftb (void)
 {
     if (!_fftb) return;
-    for (uint16_t i = 0; i < _npar; i++)
-    {
-        fftwf_free ( _fftb [i]);
-    }
+    fftwf_free (_fftd);
     delete[] _fftb;
+    delete[] _fftscale;
     _fftb = 0;
+    _fftd = 0;
+    _fftscale = 0;
     _npar = 0;
 }
 
 
-Outnode::Outnode (uint16_t out, int32_t size):
-    _next (0),
-    _list (0),
+Outnode::Outnode (uint16_t out, float *buff, int32_t size, uint16_t maxmac):
+    _nmac (0),
     _out (out)
 {
-    _buff [0] = calloc_real (size);
-    _buff [1] = calloc_real (size);
-    _buff [2] = calloc_real (size);
+    _macv = new Macnode * [maxmac];
+    _buff [0] = buff;
+    _buff [1] = buff + size;
+    _buff [2] = buff + 2 * size;
 }
     
 
 Outnode::~Outnode (void)
 {
-    fftwf_free (_buff [0]);
-    fftwf_free (_buff [1]);
-    fftwf_free (_buff [2]);
+    delete[] _macv;
+}
+
+
+// ----------------------------------------------------------------------------
+
+
+int  Convpool::_conf_nthr = 0;
+bool Convpool::_conf_affinity = false;
+
+
+void Convpool::configure (int nthr, bool affinity)
+{
+    _conf_nthr = nthr;
+    _conf_affinity = affinity;
+}
+
+
+Convpool::Convpool (void) :
+    _quit (false),
+    _nthr (0),
+    _next (0)
+{
+    pthread_mutex_init (&_lock, 0);
+}
+
+
+Convpool::~Convpool (void)
+{
+    int i;
+
+    _quit = true;
+    for (i = 0; i < _nthr; i++) _workers [i]._trig.post ();
+    for (i = 0; i < _nthr; i++)
+    {
+        pthread_join (_workers [i]._pthr, 0);
+        pthread_mutex_destroy (&_workers [i]._lock);
+    }
+    pthread_mutex_destroy (&_lock);
+}
+
+
+Convpool *Convpool::instance (void)
+{
+    static Convpool pool;
+
+    return &pool;
+}
+
+
+// Starts the workers on first use. Returns false if
+// none could be created, levels then run inline.
+
+bool Convpool::start (int abspri, int policy)
+{
+    int                i, n, min, max, r;
+    pthread_attr_t     attr;
+    struct sched_param parm;
+    Worker             *W;
+
+    pthread_mutex_lock (&_lock);
+    if (_nthr == 0)
+    {
+        n = _conf_nthr;
+        if (n <= 0) n = online_cores ();
+        if (n < 1) n = 1;
+        if (n > MAXTHR) n = MAXTHR;
+        min = sched_get_priority_min (policy);
+        max = sched_get_priority_max (policy);
+        if (abspri > max) abspri = max;
+        if (abspri < min) abspri = min;
+        parm.sched_priority = abspri;
+        for (i = 0; i < n; i++)
+        {
+            W = _workers + i;
+            W->_pool = this;
+            W->_index = i;
+            W->_head = 0;
+            W->_idle = true;
+            init_queue_lock (&W->_lock);
+            pthread_attr_init (&attr);
+            pthread_attr_setschedpolicy (&attr, policy);
+            pthread_attr_setschedparam (&attr, &parm);
+            pthread_attr_setscope (&attr, PTHREAD_SCOPE_SYSTEM);
+            pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setstacksize (&attr, 0x10000);
+            r = pthread_create (&W->_pthr, &attr, static_main, W);
+            pthread_attr_destroy (&attr);
+            if (r)
+            {
+                pthread_mutex_destroy (&W->_lock);
+                break;
+            }
+#ifdef __linux__
+            if (_conf_affinity)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO (&cpus);
+                CPU_SET (i, &cpus);
+                pthread_setaffinity_np (W->_pthr, sizeof (cpus), &cpus);
+            }
+#endif
+            _nthr++;
+        }
+    }
+    pthread_mutex_unlock (&_lock);
+    return _nthr > 0;
+}
+
+
+// The home worker is always posted, it drains its queue
+// before waiting again. If it is busy one idle worker is
+// posted as well to steal the level.
+
+void Convpool::submit (Convlevel *L)
+{
+    Worker     *W = _workers + L->_home;
+    Convlevel  **p;
+    int        i, k;
+    bool       idle;
+
+    pthread_mutex_lock (&W->_lock);
+    L->_deadline = L->_due;
+    for (p = &W->_head; *p && ((*p)->_deadline <= L->_deadline); p = &(*p)->_qnext);
+    L->_qnext = *p;
+    *p = L;
+    pthread_mutex_unlock (&W->_lock);
+    W->_trig.post ();
+
+    if (W->_idle.load (std::memory_order_acquire)) return;
+    for (k = 1; k < _nthr; k++)
+    {
+        i = (L->_home + k) % _nthr;
+        idle = true;
+        if (_workers [i]._idle.compare_exchange_strong (idle, false, std::memory_order_acq_rel))
+        {
+            _workers [i]._trig.post ();
+            return;
+        }
+    }
+}
+
+
+// Takes the first level of the worker's own queue. Only
+// when that is empty it steals the level with the earliest
+// deadline from the other queues. Returns 0 if there is
+// nothing left to run.
+
+Convlevel *Convpool::take (int self)
+{
+    int        i, k, best;
+    int64_t    first;
+    Worker     *W = _workers + self;
+    Convlevel  *L;
+
+    pthread_mutex_lock (&W->_lock);
+    L = W->_head;
+    if (L) W->_head = L->_qnext;
+    pthread_mutex_unlock (&W->_lock);
+    if (L) return L;
+
+    best = -1;
+    first = 0;
+    for (k = 1; k < _nthr; k++)
+    {
+        i = (self + k) % _nthr;
+        pthread_mutex_lock (&_workers [i]._lock);
+        L = _workers [i]._head;
+        if (L && ((best < 0) || (L->_deadline < first)))
+        {
+            best = i;
+            first = L->_deadline;
+        }
+        pthread_mutex_unlock (&_workers [i]._lock);
+    }
+    if (best < 0) return 0;
+
+    // May have been taken meanwhile, its
+    // home worker runs whatever is left
+    pthread_mutex_lock (&_workers [best]._lock);
+    L = _workers [best]._head;
+    if (L) _workers [best]._head = L->_qnext;
+    pthread_mutex_unlock (&_workers [best]._lock);
+    return L;
+}
+
+
+void *Convpool::static_main (void *arg)
+{
+    Worker    *W = (Worker *) arg;
+    Convpool  *P = W->_pool;
+    Convlevel *L;
+
+    while (true)
+    {
+        W->_trig.wait ();
+        if (P->_quit) return 0;
+        W->_idle.store (false, std::memory_order_release);
+        while ((L = P->take (W->_index)) != 0) L->cycle ();
+        W->_idle.store (true, std::memory_order_release);
+    }
 }
@@ -24,6 +24,7 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <atomic>
 #include <fftw3.h>
 
 
@@ -34,6 +35,11 @@
 extern int zita_convolver_major_version (void);
 extern int zita_convolver_minor_version (void);
 
+// The FFTW planner is not thread safe. Plans are
+// created and destroyed holding this lock, code
+// using FFTW next to the convolver must take it too.
+extern pthread_mutex_t zita_convolver_fftw_lock;
+
 
 // ----------------------------------------------------------------------------
 
@@ -154,6 +160,69 @@ private:
 // ----------------------------------------------------------------------------
 
 
+class Convlevel;
+
+
+// Process-wide workers running the background levels of
+// all Convprocs, instead of one thread per level. A level
+// has at most one cycle queued or running at a time, queued
+// levels run earliest deadline first. Each worker has its
+// own queue and sleeps on its own semaphore. A submit wakes
+// the level's home worker, and one idle worker as well if
+// the home one is busy. A worker whose own queue is empty
+// steals the level due first from the others.
+
+class Convpool
+{
+public:
+
+    enum { MAXTHR = 64 };
+
+    // Takes effect if called before the first Convproc
+    // starts. 0 threads is one per core, 'affinity' pins
+    // each worker to its own core.
+    static void configure (int nthr, bool affinity);
+
+private:
+
+    friend class Convlevel;
+
+    Convpool (void);
+    ~Convpool (void);
+
+    static Convpool *instance (void);
+
+    bool start (int abspri, int policy);
+    void submit (Convlevel *L);
+    Convlevel *take (int self);
+
+    static void *static_main (void *arg);
+
+    struct Worker
+    {
+        Convpool         *_pool;
+        int               _index;
+        pthread_t         _pthr;
+        pthread_mutex_t   _lock;
+        Convlevel        *_head;          // queued levels by deadline
+        ZCsema            _trig;          // posted when there is work
+        std::atomic<bool> _idle;          // waiting on _trig
+    };
+
+    static int          _conf_nthr;
+    static bool         _conf_affinity;
+
+    pthread_mutex_t     _lock;            // held while starting
+    volatile bool       _quit;
+    int                 _nthr;
+    std::atomic<int>    _next;            // home queue of the next level
+    Worker              _workers [MAXTHR];
+};
+
+
+// ----------------------------------------------------------------------------
+
+
 class Inpnode   
 {
 private:
@@ -162,11 +231,11 @@ private:
 
     Inpnode (uint16_t inp);
     ~Inpnode (void);
-    void alloc_ffta (uint16_t npar, int32_t size);
+    void set_ffta (uint16_t npar, fftwf_complex *data, uint32_t stride);
     void free_ffta (void);
     
-    Inpnode        *_next;
-    fftwf_complex **_ffta;
+    fftwf_complex **_ffta;                // partitions, in the Convproc arena
+    bool           *_zero;                // partitions of zero input, not computed
     uint16_t        _npar;
     uint16_t        _inp;
 };
@@ -180,13 +249,14 @@ private:
 
     Macnode (Inpnode *inpn);
     ~Macnode (void);
-    void alloc_fftb (uint16_t npar);
+    void alloc_fftb (uint16_t npar, uint32_t stride, bool half);
     void free_fftb (void);
 
-    Macnode        *_next;
     Inpnode        *_inpn;
     Macnode        *_link;
-    fftwf_complex **_fftb;
+    fftwf_complex **_fftb;                // partitions in use, or 0
+    fftwf_complex  *_fftd;                // all partitions, one block
+    float          *_fftscale;            // per partition, half precision only
     uint16_t        _npar;
 };
 
@@ -197,12 +267,12 @@ private:
 
     friend class Convlevel;
 
-    Outnode (uint16_t out, int32_t size);
+    Outnode (uint16_t out, float *buff, int32_t size, uint16_t maxmac);
     ~Outnode (void);
     
-    Outnode        *_next;
-    Macnode        *_list;
-    float          *_buff [3];
+    Macnode       **_macv;                // inputs feeding this output
+    uint16_t        _nmac;
+    float          *_buff [3];            // in the Convproc arena
     uint16_t        _out;
 };
 
@@ -231,12 +301,14 @@ class Convlevel
 private:
 
     friend class Convproc;
+    friend class Convpool;
 
     enum 
     {
         OPT_FFTW_MEASURE = 1,
         OPT_VECTOR_MODE  = 2,
-        OPT_LATE_CONTIN  = 4
+        OPT_LATE_CONTIN  = 4,
+        OPT_HALF_SPECTRA = 8
     };
 
     enum
@@ -255,6 +327,10 @@ private:
                     uint32_t parsize,
 		    uint32_t options);
 
+    uint32_t arena_size (uint32_t ninp, uint32_t nout);
+
+    void attach (float *data, uint32_t ninp, uint32_t nout);
+
     void impdata_write (uint32_t  inp,
                         uint32_t  out,
                         int32_t   step,
@@ -271,6 +347,10 @@ private:
                        uint32_t  inp2,
                        uint32_t  out2);
 
+    void impdata_share (Convlevel *source,
+                        uint32_t  inp,
+                        uint32_t  out);
+
     void reset (uint32_t  inpsize,
                 uint32_t  outsize,
 	        float     **inpbuff,
@@ -286,18 +366,22 @@ private:
 
     void cleanup (void);
 
-    void fftswap (fftwf_complex *p);
+    void fftsplit (fftwf_complex *p);
+
+    void fftjoin (fftwf_complex *p);
+
+    void halfwrite (uint16_t *fftb, float *scale);
 
     void print (FILE *F);
 
-    static void *static_main (void *arg);
+    void trigger (void);
 
-    void main (void);
+    void cycle (void);
 
     Macnode *findmacnode (uint32_t inp, uint32_t out, bool create);
 
 
-    volatile uint32_t   _stat;           // current processing state
+    std::atomic<uint32_t> _stat;         // current processing state
     int                 _prio;           // relative priority
     uint32_t            _offs;           // offset from start of impulse response
     uint32_t            _npar;           // number of partitions
@@ -307,20 +391,37 @@ private:
     uint32_t            _inpsize;        // size of shared input buffer 
     uint32_t            _inpoffs;        // offset into input buffer
     uint32_t            _options;        // various options
+    uint32_t            _vecw;           // bins per split group, 1 if not split
+    void              (*_mac) (fftwf_complex *D, const fftwf_complex *A,
+                               const fftwf_complex *B, uint32_t n);
+    bool                _half;           // IR spectra stored as FP16
+    void              (*_mach) (fftwf_complex *D, const fftwf_complex *A,
+                                const uint16_t *B, float s, uint32_t n);
     uint32_t            _ptind;          // rotating partition index
     uint32_t            _opind;          // rotating output buffer index
     int                 _bits;           // bit identifiying this level
     int                 _wait;           // number of unfinished cycles
-    pthread_t           _pthr;           // posix thread executing this level
-    ZCsema              _trig;           // sema used to trigger a cycle
     ZCsema              _done;           // sema used to wait for a cycle
-    Inpnode            *_inp_list;       // linked list of active inputs
-    Outnode            *_out_list;       // linked list of active outputs
+    std::atomic<int>    _pending;        // cycles triggered, not finished
+    std::atomic<int64_t> _due;           // deadline of the next cycle
+    int64_t             _last;           // time of the last trigger
+    int64_t             _deadline;       // while queued in the pool
+    int                 _home;           // pool queue of this level
+    Convlevel          *_qnext;          // next level in that queue
+    Inpnode           **_inpv;           // active inputs
+    Outnode           **_outv;           // active outputs
+    uint32_t            _ninpv;
+    uint32_t            _noutv;
+    uint32_t            _maxinp;         // Convproc inputs
+    uint32_t            _maxout;         // Convproc outputs
+    uint32_t            _cstride;        // spacing of spectra, padded
+    fftwf_complex      *_ffta_data;      // input spectra in the arena
+    float              *_outb_data;      // output buffers in the arena
     fftwf_plan          _plan_r2c;       // FFTW plan, forward FFT
     fftwf_plan          _plan_c2r;       // FFTW plan, inverse FFT
     float              *_time_data;      // workspace
     float              *_prep_data;      // workspace
-    fftwf_complex      *_freq_data;      // workspace
+    fftwf_complex      *_freq_data;      // accumulator, in the arena
     float             **_inpbuff;        // array of shared input buffers
     float             **_outbuff;        // array of shared output buffers
 };
@@ -354,7 +455,10 @@ public:
     {
         OPT_FFTW_MEASURE = Convlevel::OPT_FFTW_MEASURE, 
         OPT_VECTOR_MODE  = Convlevel::OPT_VECTOR_MODE,
-        OPT_LATE_CONTIN  = Convlevel::OPT_LATE_CONTIN
+        OPT_LATE_CONTIN  = Convlevel::OPT_LATE_CONTIN,
+        // IR spectra in half precision, needs OPT_VECTOR_MODE
+        // and a CPU with F16C, falls back to float otherwise
+        OPT_HALF_SPECTRA = Convlevel::OPT_HALF_SPECTRA
     };
 
     enum
@@ -362,7 +466,7 @@ public:
 	MAXINP   = 64,
 	MAXOUT   = 64,
 	MAXLEV   = 8,
-	MINPART  = 64,
+	MINPART  = 16,
 	MAXPART  = 8192,
 	MAXDIVIS = 16,
 	MINQUANT = 16,
@@ -414,6 +518,12 @@ public:
                       uint32_t  inp2,
                       uint32_t  out2);
 
+    // Use the IR partitions of another, identically
+    // configured Convproc. The source must outlive this one.
+    int impdata_share (const Convproc *source,
+                       uint32_t  inp,
+                       uint32_t  out);
+
     // Deprecated, use impdata_link() instead.
     int impdata_copy (uint32_t  inp1,
                       uint32_t  out1,
@@ -459,6 +569,7 @@ private:
     uint32_t    _inpsize;                 // size of input buffers
     uint32_t    _latecnt;                 // count of cycles ending too late
     Convlevel  *_convlev [MAXLEV];        // array of processors 
+    float      *_arena;                   // state of all levels
     void       *_dummy [64];
 
     static float  _mac_cost;
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+// Null test of half precision IR spectra:
+// prints the error of each *.tapf profile
+// against the float convolver path.
+//
+// ir_nulltest [-r rate] [-p partition] profile.tapf...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../include/ircache.h"
+#include "../include/tapffile.h"
+
+int main(int argc, char **argv)
+{
+  float rate = 48000.0;
+  stIrOptions options;
+  int status = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc))
+    {
+      rate = atof(argv[++i]);
+      continue;
+    }
+    if ((strcmp(argv[i], "-p") == 0) && (i + 1 < argc))
+    {
+      options.partition = atoi(argv[++i]);
+      continue;
+    }
+
+    TapfFile tapf;
+    IrCache::stNullTest result;
+    if (!tapf.open(argv[i]) || !IrCache::null_test(tapf, rate, options, result))
+    {
+      fprintf(stderr, "%s: can not load profile\n", argv[i]);
+      status = 1;
+      continue;
+    }
+
+    printf("%s\n", argv[i]);
+    printf("  preamp:  peak %7.1f dB, rms %7.1f dB\n",
+           result.preamp_peak_db, result.preamp_rms_db);
+    printf("  cabinet: peak %7.1f dB, rms %7.1f dB\n",
+           result.cabinet_peak_db, result.cabinet_rms_db);
+  }
+
+  return status;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+// Impulse round trip through PlugProcessor: compares
+// the latency reported to the host with the delay
+// of the output against a zero latency run, for
+// aligned, unaligned and grown host blocks.
+// Exits with 1 if any of them differ.
+//
+// latency_check [-r rate] profile.tapf
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../include/plugprocessor.h"
+
+using namespace Steinberg;
+using namespace Steinberg::Vst;
+
+// Output is aligned if it matches the
+// reference this close, relative to its peak
+#define CHECK_ERROR_DB -80.0
+
+// Output below this level is no response yet
+#define CHECK_THRESHOLD 1e-6
+
+class CheckProcessor : public PlugProcessor
+{
+public:
+  void configure(uint32_t partition, bool pipeline)
+  {
+    partitionSetting = partition;
+    pipelineSetting = pipeline;
+  }
+
+  bool loaded() const { return profile != nullptr; }
+};
+
+struct stCase
+{
+  const char *name;
+  int32 maxBlock;   // Announced in setupProcessing()
+  int32 block;      // Actually sent
+  uint32_t partition;
+  bool pipeline;
+};
+
+static const stCase cases[] =
+{
+  {"aligned",                256, 256,    0, false},
+  {"aligned, pipeline",      256, 256,    0, true},
+  {"unaligned",              100, 100,    0, false},
+  {"unaligned, pipeline",    100, 100,    0, true},
+  {"grown",                  256, 100,    0, false},
+  {"grown, pipeline",        256, 100,    0, true},
+  {"grown, partition 1024", 1024, 100, 1024, false}
+};
+
+// Impulse response of one setup, 'length' samples
+// from the block holding the impulse on
+static bool run(const char *path, double rate, const stCase &test,
+                std::vector<float> &response, uint32 &latency)
+{
+  CheckProcessor *processor = new CheckProcessor();
+  processor->initialize(nullptr);
+  processor->configure(test.partition, test.pipeline);
+
+  ProcessSetup setup;
+  setup.processMode = kRealtime;
+  setup.symbolicSampleSize = kSample32;
+  setup.maxSamplesPerBlock = test.maxBlock;
+  setup.sampleRate = rate;
+  processor->setupProcessing(setup);
+  processor->receiveText(path);
+  processor->setActive(true);
+
+  std::vector<float> left(test.block), right(test.block);
+  float *channels[2] = {left.data(), right.data()};
+
+  AudioBusBuffers bus;
+  bus.numChannels = 2;
+  bus.silenceFlags = 0;
+  bus.channelBuffers32 = channels;
+
+  ProcessData data;
+  data.processMode = kRealtime;
+  data.symbolicSampleSize = kSample32;
+  data.numSamples = test.block;
+  data.numInputs = 1;
+  data.numOutputs = 1;
+  data.inputs = &bus;
+  data.outputs = &bus;
+  data.inputParameterChanges = nullptr;
+  data.outputParameterChanges = nullptr;
+
+  // Silence until the loader thread
+  // has handed over the profile
+  for (int i = 0; (i < 1000) && !processor->loaded(); i++)
+  {
+    std::fill(left.begin(), left.end(), 0.0);
+    std::fill(right.begin(), right.end(), 0.0);
+    processor->process(data);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  bool loaded = processor->loaded();
+
+  for (size_t pos = 0; loaded && (pos < response.size()); pos += test.block)
+  {
+    std::fill(left.begin(), left.end(), 0.0);
+    std::fill(right.begin(), right.end(), 0.0);
+    if (pos == 0)
+    {
+      left[0] = right[0] = 0.5;
+    }
+
+    processor->process(data);
+
+    size_t count = std::min(response.size() - pos, (size_t)test.block);
+    memcpy(response.data() + pos, left.data(), count * sizeof(float));
+  }
+
+  latency = processor->getLatencySamples();
+
+  processor->setActive(false);
+  processor->terminate();
+  processor->release();
+
+  return loaded;
+}
+
+static int64 first_response(const std::vector<float> &response)
+{
+  for (size_t i = 0; i < response.size(); i++)
+  {
+    if (fabs(response[i]) >= CHECK_THRESHOLD)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char **argv)
+{
+  double rate = 48000.0;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc))
+      rate = atof(argv[++i]);
+    else
+      path = argv[i];
+  }
+
+  if (!path)
+  {
+    fprintf(stderr, "usage: latency_check [-r rate] profile.tapf\n");
+    return 1;
+  }
+
+  // One second, past the cabinet IR
+  size_t length = rate;
+
+  // Zero latency run, every block one partition
+  stCase reference = {"reference", fragm, fragm, fragm, false};
+  std::vector<float> expected(length, 0.0);
+  uint32 latency = 0;
+  if (!run(path, rate, reference, expected, latency) || (latency != 0))
+  {
+    fprintf(stderr, "%s: no zero latency reference\n", path);
+    return 1;
+  }
+
+  int64 start = first_response(expected);
+  float peak = 0.0;
+  for (float sample : expected)
+  {
+    peak = std::max(peak, fabsf(sample));
+  }
+
+  printf("%s\n", path);
+  printf("  %-24s %8s %8s %10s\n", "", "reported", "measured", "error");
+
+  int status = 0;
+  for (const stCase &test : cases)
+  {
+    std::vector<float> response(length, 0.0);
+    if (!run(path, rate, test, response, latency))
+    {
+      fprintf(stderr, "%s: can not load profile\n", path);
+      return 1;
+    }
+
+    int64 first = first_response(response);
+    int64 measured = ((first >= 0) && (start >= 0)) ? first - start : -1;
+
+    // Output shifted back by the reported
+    // latency against the reference
+    float error = 0.0;
+    for (size_t i = 0; i + latency < length; i++)
+    {
+      error = std::max(error, fabsf(response[i + latency] - expected[i]));
+    }
+    double error_db = 20.0 * log10(std::max(error / peak, 1e-12f));
+
+    bool passed = (measured == latency) && (error_db < CHECK_ERROR_DB);
+    if (!passed)
+    {
+      status = 1;
+    }
+
+    printf("  %-24s %8u %8lld %7.1f dB%s\n", test.name, latency,
+           (long long)measured, error_db, passed ? "" : "  FAILED");
+  }
+
+  return status;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2018-2020 Oleg Kapitonov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ * --------------------------------------------------------------------------
+ */
+
+// Times PlugProcessor::process() on the calling
+// thread, the cost the host sees on its audio thread.
+// Run it under perf stat for cache misses.
+//
+// tubeamp_bench [-r rate] [-b block] [-s seconds]
+//               [-p partition] [-t tile] [--pipeline] profile.tapf
+//
+// '-t 0' runs the stages between the convolvers over
+// whole chain calls instead of CHAIN_TILE sized tiles.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../include/plugprocessor.h"
+
+using namespace Steinberg;
+using namespace Steinberg::Vst;
+
+// Settings are set directly, the
+// controller is not there to send them
+class BenchProcessor : public PlugProcessor
+{
+public:
+  void configure(uint32_t partition, bool pipeline, int32 tile)
+  {
+    partitionSetting = partition;
+    pipelineSetting = pipeline;
+    chainTile = tile;
+  }
+
+  bool loaded() const { return profile != nullptr; }
+  uint32_t partition() const { return irOptions.partition; }
+  int32 tile() const { return chainTile; }
+};
+
+int main(int argc, char **argv)
+{
+  double rate = 48000.0;
+  int32 block = 256;
+  double seconds = 10.0;
+  uint32_t partition = 0;
+  int32 tile = CHAIN_TILE;
+  bool pipeline = false;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc))
+      rate = atof(argv[++i]);
+    else if ((strcmp(argv[i], "-b") == 0) && (i + 1 < argc))
+      block = std::max(atoi(argv[++i]), 1);
+    else if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc))
+      seconds = atof(argv[++i]);
+    else if ((strcmp(argv[i], "-p") == 0) && (i + 1 < argc))
+      partition = atoi(argv[++i]);
+    else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc))
+      tile = std::max(atoi(argv[++i]), 0);
+    else if (strcmp(argv[i], "--pipeline") == 0)
+      pipeline = true;
+    else
+      path = argv[i];
+  }
+
+  if (!path)
+  {
+    fprintf(stderr, "usage: tubeamp_bench [-r rate] [-b block] [-s seconds]\n"
+                    "                     [-p partition] [-t tile] [--pipeline] profile.tapf\n");
+    return 1;
+  }
+
+  BenchProcessor *processor = new BenchProcessor();
+  processor->initialize(nullptr);
+  processor->configure(partition, pipeline, tile);
+
+  ProcessSetup setup;
+  setup.processMode = kRealtime;
+  setup.symbolicSampleSize = kSample32;
+  setup.maxSamplesPerBlock = block;
+  setup.sampleRate = rate;
+  processor->setupProcessing(setup);
+  processor->receiveText(path);
+  processor->setActive(true);
+
+  std::vector<float> left(block), right(block);
+  float *channels[2] = {left.data(), right.data()};
+
+  AudioBusBuffers bus;
+  bus.numChannels = 2;
+  bus.silenceFlags = 0;
+  bus.channelBuffers32 = channels;
+
+  ProcessData data;
+  data.processMode = kRealtime;
+  data.symbolicSampleSize = kSample32;
+  data.numSamples = block;
+  data.numInputs = 1;
+  data.numOutputs = 1;
+  data.inputs = &bus;
+  data.outputs = &bus;
+  data.inputParameterChanges = nullptr;
+  data.outputParameterChanges = nullptr;
+
+  int64 position = 0;
+  auto fill = [&]()
+  {
+    for (int32 i = 0; i < block; i++, position++)
+    {
+      left[i] = right[i] = 0.1 * sin(2.0 * M_PI * 220.0 * position / rate);
+    }
+  };
+
+  // Profile is loaded on the loader thread
+  for (int i = 0; (i < 1000) && !processor->loaded(); i++)
+  {
+    fill();
+    processor->process(data);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  if (!processor->loaded())
+  {
+    fprintf(stderr, "%s: can not load profile\n", path);
+    return 1;
+  }
+
+  int64 blocks = std::max((int64)(seconds * rate / block), (int64)1);
+  double total = 0.0;
+  double worst = 0.0;
+
+  for (int64 b = 0; b < blocks; b++)
+  {
+    fill();
+    auto start = std::chrono::steady_clock::now();
+    processor->process(data);
+    double time = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+    total += time;
+    worst = std::max(worst, time);
+  }
+
+  double realtime = blocks * block / rate * 1e9;
+
+  printf("%s\n", path);
+  printf("  %.0f Hz, block %d, partition %u, tile %d%s\n", rate, block,
+         processor->partition(), processor->tile(), pipeline ? ", pipeline" : "");
+  printf("  %.2f ns/sample, worst block %.1f us, %.2f%% of real time\n",
+         total / (blocks * block), worst / 1000.0, 100.0 * total / realtime);
+
+  processor->setActive(false);
+  processor->terminate();
+  processor->release();
+
+  return 0;
+}